@@ -3,7 +3,6 @@
 #include "utils/com_error_handler.h"
 #include "utils/window.h"
 
-#define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
 #include <filesystem>
@@ -12,7 +11,7 @@
 void cg::renderer::dx12_renderer::init()
 {
 	model = std::make_shared<cg::world::model>();
-	model->load_obj(settings->model_path);
+	model->load_obj(settings->model_path, settings->mesh_cache, settings->mesh_optimization, settings->lod_levels);
 
 	camera = std::make_shared<cg::world::camera>();
     camera->set_height(static_cast<float>(settings->height));
@@ -342,12 +341,22 @@ void cg::renderer::dx12_renderer::load_assets()
 
 	for (size_t i = 0; i < model->get_index_buffers().size(); ++i) 
 	{
-		auto vertex_buffer_data = model->get_vertex_buffers()[i];
-		const UINT vertex_buffer_size = static_cast<UINT>(vertex_buffer_data->size_bytes());
+		// The input layout takes interleaved vertices with their material, so the streams are merged for the upload
+		const auto positions = model->get_position_buffers()[i]->view();
+		const auto attributes = model->get_attribute_buffers()[i]->view();
+		const cg::material& material = model->get_materials()[model->get_per_shape_material_ids()[i]];
+		std::vector<cg::vertex> vertex_buffer_data(positions.size);
+		for (size_t v = 0; v < positions.size; v++)
+		{
+			vertex_buffer_data[v] = cg::vertex{
+					positions[v], attributes[v].normal, attributes[v].texture,
+					material.ambient, material.diffuse, material.emissive};
+		}
+		const UINT vertex_buffer_size = static_cast<UINT>(vertex_buffer_data.size() * sizeof(cg::vertex));
 		std::wstring vertex_buffer_name(L"Vertex buffer ");
 		vertex_buffer_name += std::to_wstring(i);
 		create_resource_on_upload_heap(vertex_buffers[i], vertex_buffer_size, vertex_buffer_name);
-		copy_data(vertex_buffer_data->get_data(), vertex_buffer_size, vertex_buffers[i]);
+		copy_data(vertex_buffer_data.data(), vertex_buffer_size, vertex_buffers[i]);
 		vertex_buffer_views[i] = create_vertex_buffer_view(vertex_buffers[i], vertex_buffer_size);
 
 		auto index_buffer_data = model->get_index_buffers()[i];
@@ -403,10 +412,12 @@ void cg::renderer::dx12_renderer::populate_command_list()
 	const float clear_color[] = {0.f, 0.f, 0.f, 1.f};
 	command_list->ClearRenderTargetView(rtv_heap.get_cpu_descriptor_handle(frame_index), clear_color, 0, nullptr);
 
-	for (size_t s = 0; s < model->get_vertex_buffers().size(); s++) {
+	for (size_t s = 0; s < model->get_index_buffers().size(); s++) {
 		command_list->IASetVertexBuffers(0, 1, &vertex_buffer_views[s]);
 		command_list->IASetIndexBuffer(&index_buffer_views[s]);
-		command_list->DrawIndexedInstanced(static_cast<UINT>(model->get_index_buffers()[s]->count()), 1, 0, 0, 0);
+		// All the levels of detail are uploaded with the shape, a level is a range of its index buffer
+		const cg::world::shape_lod& lod = settings->lod_error > 0.f ? model->select_lod(s, *camera, settings->lod_error) : model->get_per_shape_lods()[s][0];
+		command_list->DrawIndexedInstanced(lod.index_count, 1, lod.index_offset, 0, 0);
 	}
 
 	D3D12_RESOURCE_BARRIER end_barriers[] = {
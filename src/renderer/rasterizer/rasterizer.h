@@ -1,24 +1,339 @@
 #pragma once
 
 #include "resource.h"
+#include "utils/mesh_compression.h"
+#include "world/camera.h"
 
+#include <algorithm>
+#include <cmath>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <limits>
 #include <memory>
+#include <vector>
 
 
 using namespace linalg::aliases;
 
 static constexpr float DEFAULT_DEPTH = std::numeric_limits<float>::max();
+// Side of the square screen tiles used by the hierarchical depth and the fast clear,
+// the same as the tiles of the tiled resource layouts
+static constexpr size_t TILE_SIZE = cg::RESOURCE_TILE_SIZE;
+// Triangles set up together by one task of a batched draw without meshlets
+static constexpr size_t BATCH_CHUNK_TRIANGLES = 128;
+// Entries of the FIFO post-transform cache, the size cg::world::optimize_vertex_cache() orders for
+static constexpr size_t POST_TRANSFORM_CACHE_SIZE = 16;
+// Triangles whose planes the visibility buffer resolve keeps while it shades a tile
+static constexpr size_t RESOLVE_PLANE_CACHE_SIZE = 8;
+// Vertices of the multisampled modes snap to 1/16 of a pixel
+static constexpr int SUBPIXEL_SCALE = 16;
+// Screen positions are clamped to this many pixels around the origin before they snap,
+// so the sub-pixel coordinates fit in an int and their edge functions in 64 bits
+static constexpr float GUARD_BAND = static_cast<float>(1 << 26);
+// Sample positions of the multisampled modes, in 1/16 of a pixel from its center.
+// These are the standard patterns of Direct3D, rotated so that every row and
+// column of a pixel has one sample.
+static constexpr int MSAA_4X_PATTERN[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+static constexpr int MSAA_8X_PATTERN[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
 
 namespace cg::renderer
 {
-	template<typename VB, typename RT>
+	enum class cull_mode
+	{
+		none,
+		front,
+		back
+	};
+
+	enum class depth_function
+	{
+		less,
+		less_equal
+	};
+
+	enum class blend_mode
+	{
+		// The pixel shader output replaces the target and the depth is written
+		opaque,
+		// Weighted blended order-independent transparency: the depth is tested but not
+		// written and the colors add up in the transparency buffers, which
+		// resolve_transparency() composites over the render target
+		weighted
+	};
+
+	// Counters of the last draw call, filled during triangle setup
+	struct draw_statistics
+	{
+		size_t triangles = 0;
+		size_t rasterized = 0;
+		size_t culled_facing = 0;
+		size_t culled_zero_area = 0;
+		size_t culled_small = 0;
+		size_t culled_outside = 0;
+		size_t culled_occluded = 0;
+		size_t clipped = 0;
+		// Vertex shader invocations, the post-transform cache saves the rest
+		size_t shaded_vertices = 0;
+		// Meshlet draws cull whole meshlets before their triangles are counted above
+		size_t meshlets = 0;
+		size_t culled_meshlets_outside = 0;
+		size_t culled_meshlets_facing = 0;
+
+		size_t culled() const
+		{
+			return culled_facing + culled_zero_area + culled_small + culled_outside + culled_occluded;
+		}
+
+		draw_statistics& operator+=(const draw_statistics& other)
+		{
+			triangles += other.triangles;
+			rasterized += other.rasterized;
+			culled_facing += other.culled_facing;
+			culled_zero_area += other.culled_zero_area;
+			culled_small += other.culled_small;
+			culled_outside += other.culled_outside;
+			culled_occluded += other.culled_occluded;
+			clipped += other.clipped;
+			shaded_vertices += other.shaded_vertices;
+			meshlets += other.meshlets;
+			culled_meshlets_outside += other.culled_meshlets_outside;
+			culled_meshlets_facing += other.culled_meshlets_facing;
+			return *this;
+		}
+	};
+
+	// Fixed-size block of attributes the vertex stage passes to the pixel stage
+	template<size_t N>
+	struct varyings
+	{
+		static constexpr size_t size = N;
+		float values[N];
+
+		float2 get_float2(size_t offset) const
+		{
+			return float2{values[offset], values[offset + 1]};
+		}
+		float3 get_float3(size_t offset) const
+		{
+			return float3{values[offset], values[offset + 1], values[offset + 2]};
+		}
+		void set_float2(size_t offset, const float2& value)
+		{
+			values[offset] = value.x;
+			values[offset + 1] = value.y;
+		}
+		void set_float3(size_t offset, const float3& value)
+		{
+			values[offset] = value.x;
+			values[offset + 1] = value.y;
+			values[offset + 2] = value.z;
+		}
+	};
+
+	// Screen space plane equations (a * x + b * y + c) of a triangle. Attributes
+	// are stored divided by w, so together with the 1/w plane they interpolate
+	// perspective-correctly with two FMAs and a multiply per attribute.
+	template<typename VR>
+	struct triangle_planes
+	{
+		float3 depth;
+		float3 inv_w;
+
+		float a[VR::size];
+		float b[VR::size];
+		float c[VR::size];
+
+		float get_depth(float x, float y) const
+		{
+			return depth.x * x + depth.y * y + depth.z;
+		}
+
+		// Clip space w, the view space distance along the camera axis
+		float get_view_depth(float x, float y) const
+		{
+			return 1.f / (inv_w.x * x + inv_w.y * y + inv_w.z);
+		}
+
+		void interpolate(float x, float y, VR& result) const
+		{
+			float w = 1.f / (inv_w.x * x + inv_w.y * y + inv_w.z);
+			for (size_t i = 0; i < VR::size; i++)
+			{
+				result.values[i] = (a[i] * x + b[i] * y + c[i]) * w;
+			}
+		}
+
+		// Also returns the screen space derivatives of the perspective correct values
+		void interpolate(float x, float y, VR& result, VR& ddx, VR& ddy) const
+		{
+			float w = 1.f / (inv_w.x * x + inv_w.y * y + inv_w.z);
+			for (size_t i = 0; i < VR::size; i++)
+			{
+				float value = (a[i] * x + b[i] * y + c[i]) * w;
+				result.values[i] = value;
+				ddx.values[i] = (a[i] - value * inv_w.x) * w;
+				ddy.values[i] = (b[i] - value * inv_w.y) * w;
+			}
+		}
+	};
+
+	// Triangle after setup, snapped to the pixel grid and wound counter-clockwise,
+	// with the clamped screen bounds it may cover. Multisampled modes snap the
+	// vertices to the sub-pixel grid instead, in SUBPIXEL_SCALE units.
+	struct screen_triangle
+	{
+		int2 vertices[3];
+		int2 begin;
+		int2 end;
+		float min_z;
+		unsigned int draw_id;
+		unsigned int triangle_id;
+	};
+
+	// Reference to the triangle visible in a pixel, written instead of a color in the visibility buffer mode
+	struct visibility_sample
+	{
+		unsigned int draw_id;
+		unsigned int triangle_id;
+	};
+
+	static constexpr unsigned int INVALID_DRAW_ID = std::numeric_limits<unsigned int>::max();
+
+	// Vertex and index buffers of a draw. Every stream is either full precision or
+	// compressed, only one of each pair is set.
+	template<typename VB>
+	struct mesh_buffers
+	{
+		std::shared_ptr<resource<float3>> positions;
+		std::shared_ptr<resource<quantized_position>> quantized_positions;
+		std::shared_ptr<resource<VB>> vertices;
+		std::shared_ptr<resource<packed_vertex_attributes>> packed_vertices;
+		std::shared_ptr<resource<unsigned int>> indices;
+		std::shared_ptr<resource<uint16_t>> short_indices;
+	};
+
+	// Instance of a draw as the vertex stage sees it. Plain draws have a single
+	// instance with the identity transform.
+	struct vertex_instance
+	{
+		unsigned int id = 0;
+		float4x4 transform{
+				{1, 0, 0, 0},
+				{0, 1, 0, 0},
+				{0, 0, 1, 0},
+				{0, 0, 0, 1}};
+	};
+
+	// One draw of a batch. The per-draw constants travel in the captures of the
+	// shaders. Without meshlets the index range is drawn, with them the meshlets
+	// are culled like draw_meshlets() does and the index offset only bases the
+	// triangle ids. With an instance buffer the draw is repeated for each of its
+	// first instance_count transforms.
+	template<typename VB, typename VR>
+	struct draw_command
+	{
+		mesh_buffers<VB> buffers;
+		size_t index_offset = 0;
+		size_t index_count = 0;
+		const meshlet* meshlets = nullptr;
+		size_t num_meshlets = 0;
+		// Object to clip space and the camera in object space, for the meshlet
+		// culling. The instance transforms are applied on top of them.
+		float4x4 matrix;
+		float3 camera_position;
+		std::shared_ptr<resource<float4x4>> instances;
+		size_t instance_count = 1;
+		std::function<std::pair<float4, VR>(float4 vertex, VB vertex_data, const vertex_instance& instance)> vertex_shader;
+		std::function<float4(float4 vertex, const vertex_instance& instance)> position_shader;
+		// Empty takes the pixel shader of the rasterizer
+		std::function<cg::color(const VR& interpolated, const VR& ddx, const VR& ddy, const float z, const int2 pixel)> pixel_shader;
+	};
+
+	// Reads the vertices of mesh_buffers for the vertex stage, compressed ones are
+	// decoded right there. Quantized positions come out as they are stored, the
+	// shaders fold the dequantization into their matrices.
+	template<typename VB>
+	struct vertex_fetch
+	{
+		explicit vertex_fetch(const mesh_buffers<VB>& buffers)
+		{
+			positions = buffers.positions ? buffers.positions->data() : nullptr;
+			quantized_positions = buffers.quantized_positions ? buffers.quantized_positions->data() : nullptr;
+			vertices = buffers.vertices ? buffers.vertices->data() : nullptr;
+			packed_vertices = buffers.packed_vertices ? buffers.packed_vertices->data() : nullptr;
+			indices = buffers.indices ? buffers.indices->data() : nullptr;
+			short_indices = buffers.short_indices ? buffers.short_indices->data() : nullptr;
+		}
+
+		unsigned int index(size_t i) const
+		{
+			return short_indices ? short_indices[i] : indices[i];
+		}
+		float4 position(unsigned int i) const
+		{
+			if (quantized_positions)
+			{
+				const quantized_position& position = quantized_positions[i];
+				return float4{
+						static_cast<float>(position.x),
+						static_cast<float>(position.y),
+						static_cast<float>(position.z),
+						1.f};
+			}
+			return float4{positions[i], 1.f};
+		}
+		VB vertex(unsigned int i) const
+		{
+			if (packed_vertices)
+				return cg::utils::unpack_vertex_attributes(packed_vertices[i]);
+			return vertices[i];
+		}
+
+		const float3* positions;
+		const quantized_position* quantized_positions;
+		const VB* vertices;
+		const packed_vertex_attributes* packed_vertices;
+		const unsigned int* indices;
+		const uint16_t* short_indices;
+	};
+
+	// Max depth of every tile of the depth buffer. Writes only lower it, so a
+	// written tile is marked dirty and its max is recomputed from the depth buffer
+	// the next time a test needs it.
+	class hierarchical_depth
+	{
+	public:
+		static constexpr size_t tile_size = TILE_SIZE;
+
+		void resize(size_t in_width, size_t in_height);
+		void clear(float in_depth);
+		void update(size_t x, size_t y);
+
+		bool is_occluded(
+				int2 begin, int2 end, float min_z, depth_function function,
+				resource<float>& depth_buffer);
+
+	protected:
+		size_t width = 0;
+		size_t height = 0;
+		size_t tiles_x = 0;
+		size_t tiles_y = 0;
+
+		std::vector<float> max_depth;
+		std::vector<char> dirty;
+
+		float get_max_depth(size_t tile_x, size_t tile_y, resource<float>& depth_buffer);
+	};
+
+	template<typename VB, typename RT, typename VR>
 	class rasterizer
 	{
 	public:
+		using vertex_shader_type = std::function<std::pair<float4, VR>(float4 vertex, VB vertex_data, const vertex_instance& instance)>;
+		using position_shader_type = std::function<float4(float4 vertex, const vertex_instance& instance)>;
+		using pixel_shader_type = std::function<cg::color(const VR& interpolated, const VR& ddx, const VR& ddy, const float z, const int2 pixel)>;
+
 		rasterizer(){};
 		~rasterizer(){};
 		void set_render_target(
@@ -26,32 +341,216 @@ namespace cg::renderer
 				std::shared_ptr<resource<float>> in_depth_buffer = nullptr);
 		void clear_render_target(
 				const RT& in_clear_value, const float in_depth = DEFAULT_DEPTH);
+		void resolve_fast_clear();
+
+		void set_visibility_buffer(std::shared_ptr<resource<visibility_sample>> in_visibility_buffer);
+		void resolve_visibility_buffer();
 
+		// Sum of the weighted premultiplied colors with the weighted alpha, and the
+		// product of the transparencies. Fast cleared with the rest of the buffers.
+		void set_transparency_buffers(
+				std::shared_ptr<resource<float4>> in_accumulation_buffer,
+				std::shared_ptr<resource<float>> in_revealage_buffer);
+		// Composites the transparent surfaces of the weighted blend mode over the render target
+		void resolve_transparency();
+
+		// Turns on multisampling with 4 or 8 samples per pixel, the buffers are samples
+		// times wider than the render target and hold the samples of a pixel side by
+		// side. Coverage and depth are per sample, the pixel shader runs once per pixel
+		// and its color goes to the covered samples. The depth buffer keeps the
+		// farthest sample of every pixel for the occlusion tests. The visibility buffer
+		// stores a single sample and can't be combined with multisampling.
+		void set_multisample_targets(
+				std::shared_ptr<resource<RT>> in_sample_colors,
+				std::shared_ptr<resource<float>> in_sample_depths, size_t in_samples);
+		// Averages the samples of every drawn pixel into the render target
+		void resolve_multisampling();
+
+		// Positions and the rest of the vertex data come from separate streams indexed
+		// alike, each of them full precision or compressed
+		void set_position_buffer(std::shared_ptr<resource<float3>> in_position_buffer);
+		void set_position_buffer(std::shared_ptr<resource<quantized_position>> in_position_buffer);
 		void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
+		void set_vertex_buffer(std::shared_ptr<resource<packed_vertex_attributes>> in_vertex_buffer);
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
+		void set_index_buffer(std::shared_ptr<resource<uint16_t>> in_index_buffer);
+		void set_mesh_buffers(const mesh_buffers<VB>& in_buffers);
 
 		void set_viewport(size_t in_width, size_t in_height);
+		void set_cull_mode(cull_mode in_cull_mode);
+		void set_depth_function(depth_function in_depth_function);
+		void set_color_write(bool in_color_write);
+		// The alpha applies to every pixel of the weighted mode
+		void set_blend_mode(blend_mode in_blend_mode, float in_alpha = 1.f);
+		void set_occlusion_culling(bool in_occlusion_culling);
+
+		bool is_occluded(const float4x4& matrix, const float3& aabb_min, const float3& aabb_max);
+
+		const draw_statistics& get_draw_statistics() const;
 
 		void draw(size_t num_vertexes, size_t vertex_offset);
+		// Culls the meshlets against the frustum and their normal cones, then draws
+		// the triangles of the rest, which go through the depth test one by one like
+		// in a batch. The matrix maps object space to clip space, the camera position
+		// is in object space.
+		// Triangle ids are relative to vertex_offset, like the ones of draw().
+		void draw_meshlets(
+				const meshlet* meshlets, size_t num_meshlets, size_t vertex_offset,
+				const float4x4& matrix, const float3& camera_position);
+		// Draws all the commands in one pass: the triangles of every command are set
+		// up in parallel, binned to the screen tiles and the tiles are rasterized in
+		// parallel, each in the order of the commands. The output is the same as
+		// drawing the commands one by one, the shaders in the commands replace the
+		// ones below and the pixel shader must be safe to call from several threads.
+		// Meshlets are culled like draw_meshlets() does, the depth test of the
+		// triangles is done per tile and not counted in the statistics, which cover
+		// the whole batch.
+		void draw_batch(const std::vector<draw_command<VB, VR>>& commands);
+		// Draws the bound buffers once per transform of the instance buffer, the vertex
+		// shader gets the id and the transform of the instance. The instances go
+		// through draw_batch(), so the same rules apply to the pixel shader.
+		void draw_instanced(
+				size_t num_vertexes, size_t instance_count,
+				std::shared_ptr<resource<float4x4>> instance_buffer, size_t vertex_offset = 0);
+		// Culls the meshlets of every instance like draw_meshlets() does, the matrix and
+		// the camera position are the ones without the instance transform
+		void draw_meshlets_instanced(
+				const meshlet* meshlets, size_t num_meshlets, size_t vertex_offset,
+				const float4x4& matrix, const float3& camera_position,
+				size_t instance_count, std::shared_ptr<resource<float4x4>> instance_buffer);
 
-		std::function<std::pair<float4, VB>(float4 vertex, VB vertex_data)> vertex_shader;
-		std::function<cg::color(const VB& vertex_data, const float z)> pixel_shader;
+		vertex_shader_type vertex_shader;
+		// Optional, must give the same clip positions as vertex_shader. Used by the draws
+		// that need no varyings (depth-only and visibility buffer), they then read
+		// only the position stream.
+		position_shader_type position_shader;
+		// Gets the varyings with their screen space derivatives, for texture level of detail.
+		// Every draw keeps the one set when it was issued, for the visibility buffer resolve.
+		pixel_shader_type pixel_shader;
 
 	protected:
-		std::shared_ptr<cg::resource<VB>> vertex_buffer;
-		std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+		mesh_buffers<VB> buffers;
 		std::shared_ptr<cg::resource<RT>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<visibility_sample>> visibility_buffer;
+		std::shared_ptr<cg::resource<float4>> accumulation_buffer;
+		std::shared_ptr<cg::resource<float>> revealage_buffer;
+		std::shared_ptr<cg::resource<RT>> sample_colors;
+		std::shared_ptr<cg::resource<float>> sample_depths;
+		size_t samples = 1;
+
+		// Everything the resolve pass needs to revisit a draw of the visibility buffer mode
+		struct draw_record
+		{
+			mesh_buffers<VB> buffers;
+			size_t vertex_offset;
+			// Index into draw_shaders, shared by the records of the instances of a draw
+			size_t shaders;
+			vertex_instance instance;
+		};
+		struct recorded_shaders
+		{
+			vertex_shader_type vertex_shader;
+			pixel_shader_type pixel_shader;
+		};
+		// Both are cleared with the render target and keep their capacity between the frames
+		std::vector<draw_record> draw_records;
+		std::vector<recorded_shaders> draw_shaders;
+		std::vector<char> meshlet_visibility;
+
+		// Scratch of draw_batch(), kept between the frames to reuse the allocations
+		struct batch_instance
+		{
+			size_t command;
+			vertex_instance instance;
+			unsigned int draw_id;
+			// Culling inputs of the meshlets, in the space of the instance
+			cg::world::frustum frustum;
+			float3 camera_position;
+		};
+		struct batch_item
+		{
+			size_t instance;
+			size_t first_vertex;
+			size_t num_vertexes;
+			const meshlet* source_meshlet;
+		};
+		struct binned_triangle
+		{
+			uint32_t item;
+			uint32_t triangle;
+		};
+		std::vector<batch_instance> batch_instances;
+		std::vector<batch_item> batch_items;
+		std::vector<draw_command<VB, VR>> instanced_commands;
+		std::vector<std::vector<screen_triangle>> batch_triangles;
+		std::vector<std::vector<triangle_planes<VR>>> batch_planes;
+		std::vector<draw_statistics> batch_statistics;
+		std::vector<std::vector<binned_triangle>> tile_bins;
 
 		size_t width = 1920;
 		size_t height = 1080;
 
-		int edge_function(int2 a, int2 b, int2 c);
-		bool depth_test(float z, size_t x, size_t y);
+		cull_mode culling = cull_mode::back;
+		depth_function depth_compare = depth_function::less;
+		bool color_write = true;
+		blend_mode blending = blend_mode::opaque;
+		float blend_alpha = 1.f;
+		bool occlusion_culling = true;
+		draw_statistics statistics;
+
+		hierarchical_depth depth_tiles;
+
+		// Tiles that are logically cleared but still hold stale data
+		RT clear_value{};
+		float clear_depth = DEFAULT_DEPTH;
+		size_t tiles_x = 0;
+		size_t tiles_y = 0;
+		std::vector<char> cleared_tiles;
+
+		void materialize_tile(size_t tile_x, size_t tile_y);
+		void prepare_tile(size_t x, size_t y);
+
+		// Resets the statistics and records the draw for the visibility buffer resolve
+		unsigned int begin_draw(size_t vertex_offset);
+		void draw_triangles(size_t first_vertex, size_t num_vertexes, size_t vertex_offset, unsigned int draw_id);
+		bool is_cone_culled(const meshlet& meshlet, const float3& camera_position) const;
+
+		// Vertex processing, clipping and triangle setup of a range of indices, the
+		// triangles that survive the culling are passed to emit
+		template<typename Emit>
+		void setup_triangles(
+				const vertex_fetch<VB>& fetch, const vertex_shader_type& in_vertex_shader,
+				const position_shader_type& in_position_shader, const vertex_instance& instance,
+				size_t first_vertex, size_t num_vertexes, size_t vertex_offset, unsigned int draw_id,
+				draw_statistics& stats, Emit&& emit) const;
+		// Without attributes only the depth and 1/w planes are set up
+		bool setup_planes(
+				const float4 (&clip)[3], const VR* attributes,
+				triangle_planes<VR>& planes) const;
+		// Snaps the triangle and rejects it when it's outside, facing away or too small
+		bool setup_screen_triangle(
+				const float4 (&clip)[3], unsigned int draw_id, unsigned int triangle_id,
+				screen_triangle& triangle, draw_statistics& stats) const;
+		void setup_min_depth(screen_triangle& triangle, const triangle_planes<VR>& planes) const;
+		// Command of the instanced draws, with the bound buffers and shaders
+		draw_command<VB, VR> instanced_command(
+				size_t vertex_offset, size_t instance_count, std::shared_ptr<resource<float4x4>> instance_buffer) const;
+		// Covers the pixels of the triangle between begin and end, inclusive
+		void rasterize_region(
+				const screen_triangle& triangle, const triangle_planes<VR>& planes, int2 begin, int2 end,
+				const pixel_shader_type& shader);
+		void rasterize_multisampled_region(
+				const screen_triangle& triangle, const triangle_planes<VR>& planes, int2 begin, int2 end,
+				const pixel_shader_type& shader);
+
+		// 64 bits, the products of the sub-pixel coordinates of vertices far off the screen overflow 32
+		int64_t edge_function(int2 a, int2 b, int2 c) const;
+		bool depth_test(float z, float stored_z) const;
 	};
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_render_target(
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_render_target(
 			std::shared_ptr<resource<RT>> in_render_target,
 			std::shared_ptr<resource<float>> in_depth_buffer)
 	{
@@ -59,135 +558,1313 @@ namespace cg::renderer
 			render_target = in_render_target;
 
 		if (in_depth_buffer)
+		{
 			depth_buffer = in_depth_buffer;
+			depth_tiles.resize(depth_buffer->get_width(), depth_buffer->get_height());
+		}
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_viewport(size_t in_width, size_t in_height)
 	{
 		width = in_width;
 		height = in_height;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::clear_render_target(
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_cull_mode(cull_mode in_cull_mode)
+	{
+		culling = in_cull_mode;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_depth_function(depth_function in_depth_function)
+	{
+		depth_compare = in_depth_function;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_color_write(bool in_color_write)
+	{
+		color_write = in_color_write;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_blend_mode(blend_mode in_blend_mode, float in_alpha)
+	{
+		blending = in_blend_mode;
+		blend_alpha = in_alpha;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_occlusion_culling(bool in_occlusion_culling)
+	{
+		occlusion_culling = in_occlusion_culling;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline bool rasterizer<VB, RT, VR>::is_occluded(
+			const float4x4& matrix, const float3& aabb_min, const float3& aabb_max)
+	{
+		if (!depth_buffer || !occlusion_culling)
+			return false;
+
+		float2 min_screen{std::numeric_limits<float>::max()};
+		float2 max_screen{std::numeric_limits<float>::lowest()};
+		float min_z = std::numeric_limits<float>::max();
+		for (int corner = 0; corner < 8; corner++)
+		{
+			float4 position{
+					corner & 1 ? aabb_max.x : aabb_min.x,
+					corner & 2 ? aabb_max.y : aabb_min.y,
+					corner & 4 ? aabb_max.z : aabb_min.z,
+					1.f};
+			float4 clip = mul(matrix, position);
+			// A box crossing the near plane can't be projected conservatively
+			if (clip.w <= 0.f)
+				return false;
+
+			float3 ndc = clip.xyz() / clip.w;
+			float2 screen{(ndc.x + 1.f) * width / 2.f, (-ndc.y + 1.f) * height / 2.f};
+			min_screen = min(min_screen, screen);
+			max_screen = max(max_screen, screen);
+			min_z = std::min(min_z, ndc.z);
+		}
+
+		// Clamped before the conversion, the corners of a box near the camera may be far off the screen
+		float2 max_viewport{static_cast<float>(width - 1), static_cast<float>(height - 1)};
+		int2 begin = int2(clamp(min_screen, float2(0.f), max_viewport));
+		int2 end = int2(clamp(max_screen, float2(0.f), max_viewport));
+		return depth_tiles.is_occluded(begin, end, min_z, depth_compare, *depth_buffer);
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline const draw_statistics& rasterizer<VB, RT, VR>::get_draw_statistics() const
+	{
+		return statistics;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::clear_render_target(
 			const RT& in_clear_value, const float in_depth)
 	{
-		if (render_target)
+		// Fast clear: only the per-tile flags are reset here, a tile is filled
+		// with the clear values when it's touched first or on resolve_fast_clear()
+		clear_value = in_clear_value;
+		clear_depth = in_depth;
+		tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+		tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+		cleared_tiles.assign(tiles_x * tiles_y, 1);
+
+		if (depth_buffer)
+			depth_tiles.clear(in_depth);
+
+		draw_records.clear();
+		draw_shaders.clear();
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::resolve_fast_clear()
+	{
+		if (std::all_of(cleared_tiles.begin(), cleared_tiles.end(), [](char cleared) { return cleared != 0; }))
+		{
+			if (render_target)
+				render_target->fill(clear_value);
+			if (depth_buffer)
+				depth_buffer->fill(clear_depth);
+			if (visibility_buffer)
+				visibility_buffer->fill(visibility_sample{INVALID_DRAW_ID, 0});
+			if (accumulation_buffer)
+				accumulation_buffer->fill(float4{0.f, 0.f, 0.f, 0.f});
+			if (revealage_buffer)
+				revealage_buffer->fill(1.f);
+			if (sample_colors)
+				sample_colors->fill(clear_value);
+			if (sample_depths)
+				sample_depths->fill(clear_depth);
+		}
+		else
 		{
-			for (size_t i=0; i<render_target->count(); i++)
+#pragma omp parallel for schedule(dynamic)
+			for (int tile = 0; tile < static_cast<int>(cleared_tiles.size()); tile++)
 			{
-				render_target->item(i) = in_clear_value;
+				if (cleared_tiles[tile])
+					materialize_tile(tile % tiles_x, tile / tiles_x);
 			}
 		}
+		std::fill(cleared_tiles.begin(), cleared_tiles.end(), 0);
+	}
 
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::materialize_tile(size_t tile_x, size_t tile_y)
+	{
+		if (render_target)
+			render_target->fill_tile(tile_x, tile_y, clear_value);
 		if (depth_buffer)
+			depth_buffer->fill_tile(tile_x, tile_y, clear_depth);
+		if (visibility_buffer)
+			visibility_buffer->fill_tile(tile_x, tile_y, visibility_sample{INVALID_DRAW_ID, 0});
+		if (accumulation_buffer)
+			accumulation_buffer->fill_tile(tile_x, tile_y, float4{0.f, 0.f, 0.f, 0.f});
+		if (revealage_buffer)
+			revealage_buffer->fill_tile(tile_x, tile_y, 1.f);
+		// The samples of a tile are the next samples tiles of the wider buffers, fewer
+		// at the right side when the width isn't a multiple of the tile size
+		for (size_t sample_tile = tile_x * samples; sample_tile < (tile_x + 1) * samples; sample_tile++)
 		{
-			for (size_t i=0; i<depth_buffer->count(); i++)
+			if (sample_colors && sample_tile * TILE_SIZE < sample_colors->get_width())
+				sample_colors->fill_tile(sample_tile, tile_y, clear_value);
+			if (sample_depths && sample_tile * TILE_SIZE < sample_depths->get_width())
+				sample_depths->fill_tile(sample_tile, tile_y, clear_depth);
+		}
+		cleared_tiles[tile_y * tiles_x + tile_x] = 0;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::prepare_tile(size_t x, size_t y)
+	{
+		size_t tile_x = x / TILE_SIZE;
+		size_t tile_y = y / TILE_SIZE;
+		if (cleared_tiles[tile_y * tiles_x + tile_x])
+			materialize_tile(tile_x, tile_y);
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_visibility_buffer(
+			std::shared_ptr<resource<visibility_sample>> in_visibility_buffer)
+	{
+		visibility_buffer = in_visibility_buffer;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::resolve_visibility_buffer()
+	{
+		if (!visibility_buffer)
+			return;
+
+		// Every visible pixel is shaded exactly once, so tiles can be shaded in parallel
+#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < static_cast<int>(cleared_tiles.size()); tile++)
+		{
+			if (cleared_tiles[tile])
+				continue;
+
+			size_t tile_x = tile % tiles_x;
+			size_t tile_y = tile / tiles_x;
+			const visibility_sample* visibility_tile = visibility_buffer->tile(tile_x, tile_y);
+			RT* color_tile = render_target->tile(tile_x, tile_y);
+
+			// A few triangles usually cover a tile, their vertices are shaded and their
+			// planes set up once for all of their pixels
+			visibility_sample cached_triangles[RESOLVE_PLANE_CACHE_SIZE];
+			triangle_planes<VR> cached_planes[RESOLVE_PLANE_CACHE_SIZE];
+			bool cached_valid[RESOLVE_PLANE_CACHE_SIZE];
+			size_t cache_size = 0;
+			size_t cache_head = 0;
+			for (size_t local = 0; local < TILE_SIZE * TILE_SIZE; local++)
 			{
-				depth_buffer->item(i) = in_depth;
+				size_t local_x = local % TILE_SIZE;
+				size_t local_y = local / TILE_SIZE;
+				int x = static_cast<int>(tile_x * TILE_SIZE + local_x);
+				int y = static_cast<int>(tile_y * TILE_SIZE + local_y);
+				if (x >= static_cast<int>(width) || y >= static_cast<int>(height))
+					continue;
+
+				const visibility_sample& sample = visibility_tile[visibility_buffer->tile_offset(local_x, local_y)];
+				if (sample.draw_id == INVALID_DRAW_ID)
+					continue;
+
+				size_t entry = 0;
+				while (entry < cache_size &&
+					   (cached_triangles[entry].draw_id != sample.draw_id || cached_triangles[entry].triangle_id != sample.triangle_id))
+					entry++;
+				if (entry == cache_size)
+				{
+					const draw_record& record = draw_records[sample.draw_id];
+					const vertex_shader_type& record_shader = draw_shaders[record.shaders].vertex_shader;
+					vertex_fetch<VB> fetch(record.buffers);
+					size_t vertex_id = record.vertex_offset + 3 * static_cast<size_t>(sample.triangle_id);
+					float4 clip[3];
+					VR attributes[3];
+					for (size_t i = 0; i < 3; i++)
+					{
+						unsigned int index = fetch.index(vertex_id + i);
+						auto processed_vertex = record_shader(fetch.position(index), fetch.vertex(index), record.instance);
+						clip[i] = processed_vertex.first;
+						attributes[i] = processed_vertex.second;
+					}
+
+					// The planes are rebuilt exactly like the rasterization did
+					entry = cache_head;
+					cached_triangles[entry] = sample;
+					cached_valid[entry] = setup_planes(clip, attributes, cached_planes[entry]);
+					cache_head = (cache_head + 1) % RESOLVE_PLANE_CACHE_SIZE;
+					cache_size = std::min(cache_size + 1, RESOLVE_PLANE_CACHE_SIZE);
+				}
+				if (!cached_valid[entry])
+					continue;
+				const triangle_planes<VR>& planes = cached_planes[entry];
+
+				float sample_x = static_cast<float>(x);
+				float sample_y = static_cast<float>(y);
+				VR interpolated, ddx, ddy;
+				planes.interpolate(sample_x, sample_y, interpolated, ddx, ddy);
+				auto pixel_result = draw_shaders[draw_records[sample.draw_id].shaders].pixel_shader(
+						interpolated, ddx, ddy, planes.get_depth(sample_x, sample_y), int2{x, y});
+				color_tile[render_target->tile_offset(local_x, local_y)] = RT::from_color(pixel_result);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_transparency_buffers(
+			std::shared_ptr<resource<float4>> in_accumulation_buffer,
+			std::shared_ptr<resource<float>> in_revealage_buffer)
+	{
+		accumulation_buffer = in_accumulation_buffer;
+		revealage_buffer = in_revealage_buffer;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::resolve_transparency()
+	{
+		if (!accumulation_buffer || !revealage_buffer)
+			return;
+
+		// Tiles still waiting for their clear have no transparent surfaces
+#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < static_cast<int>(cleared_tiles.size()); tile++)
+		{
+			if (cleared_tiles[tile])
+				continue;
+
+			size_t tile_x = tile % tiles_x;
+			size_t tile_y = tile / tiles_x;
+			const float4* accumulation_tile = accumulation_buffer->tile(tile_x, tile_y);
+			const float* revealage_tile = revealage_buffer->tile(tile_x, tile_y);
+			RT* color_tile = render_target->tile(tile_x, tile_y);
+			for (size_t local = 0; local < TILE_SIZE * TILE_SIZE; local++)
+			{
+				size_t local_x = local % TILE_SIZE;
+				size_t local_y = local / TILE_SIZE;
+				if (tile_x * TILE_SIZE + local_x >= width || tile_y * TILE_SIZE + local_y >= height)
+					continue;
+
+				float revealage = revealage_tile[revealage_buffer->tile_offset(local_x, local_y)];
+				if (revealage == 1.f)
+					continue;
+				const float4& accumulation = accumulation_tile[accumulation_buffer->tile_offset(local_x, local_y)];
+				RT& color = color_tile[render_target->tile_offset(local_x, local_y)];
+				// The weighted average of the colors covers what the surfaces together don't reveal
+				float3 average = accumulation.xyz() / std::max(accumulation.w, 1e-5f);
+				color = RT::from_float3(average * (1.f - revealage) + color.to_float3() * revealage);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_multisample_targets(
+			std::shared_ptr<resource<RT>> in_sample_colors,
+			std::shared_ptr<resource<float>> in_sample_depths, size_t in_samples)
+	{
+		sample_colors = in_sample_colors;
+		sample_depths = in_sample_depths;
+		samples = in_samples;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::resolve_multisampling()
+	{
+		if (samples == 1 || !sample_colors)
+			return;
+
+		// Tiles still waiting for their clear resolve to the clear color anyway
+#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < static_cast<int>(cleared_tiles.size()); tile++)
+		{
+			if (cleared_tiles[tile])
+				continue;
+
+			size_t tile_x = tile % tiles_x;
+			size_t tile_y = tile / tiles_x;
+			RT* color_tile = render_target->tile(tile_x, tile_y);
+			// The samples of the tile span the next samples tiles of the wider buffer
+			RT* sample_tiles[8] = {};
+			for (size_t sample_tile = 0; sample_tile < samples; sample_tile++)
+			{
+				if ((tile_x * samples + sample_tile) * TILE_SIZE < sample_colors->get_width())
+					sample_tiles[sample_tile] = sample_colors->tile(tile_x * samples + sample_tile, tile_y);
+			}
+			for (size_t local = 0; local < TILE_SIZE * TILE_SIZE; local++)
+			{
+				size_t local_x = local % TILE_SIZE;
+				size_t local_y = local / TILE_SIZE;
+				size_t x = tile_x * TILE_SIZE + local_x;
+				size_t y = tile_y * TILE_SIZE + local_y;
+				if (x >= width || y >= height)
+					continue;
+
+				float3 sum{0.f, 0.f, 0.f};
+				for (size_t sample = 0; sample < samples; sample++)
+				{
+					size_t column = local_x * samples + sample;
+					sum += sample_tiles[column / TILE_SIZE][sample_colors->tile_offset(column % TILE_SIZE, local_y)].to_float3();
+				}
+				// Rounded, so that pixels with equal samples keep their color
+				float3 average = sum / static_cast<float>(samples) + float3{0.5f / 255.f};
+				color_tile[render_target->tile_offset(local_x, local_y)] = RT::from_float3(average);
 			}
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_vertex_buffer(
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_position_buffer(
+			std::shared_ptr<resource<float3>> in_position_buffer)
+	{
+		buffers.positions = in_position_buffer;
+		buffers.quantized_positions = nullptr;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_position_buffer(
+			std::shared_ptr<resource<quantized_position>> in_position_buffer)
+	{
+		buffers.positions = nullptr;
+		buffers.quantized_positions = in_position_buffer;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_vertex_buffer(
 			std::shared_ptr<resource<VB>> in_vertex_buffer)
 	{
-		vertex_buffer = in_vertex_buffer;
+		buffers.vertices = in_vertex_buffer;
+		buffers.packed_vertices = nullptr;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_index_buffer(
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_vertex_buffer(
+			std::shared_ptr<resource<packed_vertex_attributes>> in_vertex_buffer)
+	{
+		buffers.vertices = nullptr;
+		buffers.packed_vertices = in_vertex_buffer;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_index_buffer(
 			std::shared_ptr<resource<unsigned int>> in_index_buffer)
 	{
-		index_buffer = in_index_buffer;
+		buffers.indices = in_index_buffer;
+		buffers.short_indices = nullptr;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::draw(size_t num_vertexes, size_t vertex_offset)
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_index_buffer(
+			std::shared_ptr<resource<uint16_t>> in_index_buffer)
 	{
-		size_t vertex_id = vertex_offset;
+		buffers.indices = nullptr;
+		buffers.short_indices = in_index_buffer;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::set_mesh_buffers(const mesh_buffers<VB>& in_buffers)
+	{
+		buffers = in_buffers;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline unsigned int rasterizer<VB, RT, VR>::begin_draw(size_t vertex_offset)
+	{
+		statistics = draw_statistics{};
+		if (!visibility_buffer)
+			return INVALID_DRAW_ID;
+		draw_shaders.push_back(recorded_shaders{vertex_shader, pixel_shader});
+		draw_records.push_back(draw_record{buffers, vertex_offset, draw_shaders.size() - 1, vertex_instance{}});
+		return static_cast<unsigned int>(draw_records.size() - 1);
+	}
 
-		while (vertex_id < vertex_offset + num_vertexes)
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::draw(size_t num_vertexes, size_t vertex_offset)
+	{
+		unsigned int draw_id = begin_draw(vertex_offset);
+		draw_triangles(vertex_offset, num_vertexes, vertex_offset, draw_id);
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::draw_meshlets(
+			const meshlet* meshlets, size_t num_meshlets, size_t vertex_offset,
+			const float4x4& matrix, const float3& camera_position)
+	{
+		unsigned int draw_id = begin_draw(vertex_offset);
+		statistics.meshlets = num_meshlets;
+
+		// The frustum and cone tests only read the meshlets, so they run in parallel
+		auto frustum = cg::world::frustum::from_matrix(matrix);
+		meshlet_visibility.resize(num_meshlets);
+#pragma omp parallel for schedule(static) if (num_meshlets > 64)
+		for (int m = 0; m < static_cast<int>(num_meshlets); m++)
 		{
-			std::vector<VB> vertices(3);
-			vertices[0] = vertex_buffer->item(index_buffer->item(vertex_id++));
-			vertices[1] = vertex_buffer->item(index_buffer->item(vertex_id++));
-			vertices[2] = vertex_buffer->item(index_buffer->item(vertex_id++));
+			const meshlet& current = meshlets[m];
+			if (!frustum.is_sphere_visible(current.center, current.radius))
+				meshlet_visibility[m] = 0;
+			else if (is_cone_culled(current, camera_position))
+				meshlet_visibility[m] = 1;
+			else
+				meshlet_visibility[m] = 2;
+		}
 
-			for (auto& vertex : vertices)
+		// A bound of a whole meshlet against the hierarchical depth isn't conservative,
+		// the depth of its triangles is extrapolated to the snapped pixels
+		for (size_t m = 0; m < num_meshlets; m++)
+		{
+			const meshlet& current = meshlets[m];
+			if (meshlet_visibility[m] == 0)
 			{
-				float4 coords{vertex.position.x, vertex.position.y, vertex.position.z, 1.f};
-				auto processed_vertex = vertex_shader(coords, vertex);
+				statistics.culled_meshlets_outside++;
+				continue;
+			}
+			if (meshlet_visibility[m] == 1)
+			{
+				statistics.culled_meshlets_facing++;
+				continue;
+			}
+			draw_triangles(current.index_offset, current.index_count, vertex_offset, draw_id);
+		}
+	}
 
-				vertex.position = processed_vertex.first.xyz() / processed_vertex.first.w;
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::draw_batch(const std::vector<draw_command<VB, VR>>& commands)
+	{
+		statistics = draw_statistics{};
 
-				vertex.position.x = (vertex.position.x + 1.f) * width / 2.f;
-				vertex.position.y = (-vertex.position.y + 1.f) * height / 2.f;
+		// Every instance of every command is a draw of its own, with its own record
+		// for the visibility buffer resolve
+		batch_instances.clear();
+		for (size_t c = 0; c < commands.size(); c++)
+		{
+			const auto& command = commands[c];
+			if (visibility_buffer)
+			{
+				draw_shaders.push_back(recorded_shaders{
+						command.vertex_shader, command.pixel_shader ? command.pixel_shader : pixel_shader});
+			}
+			for (size_t i = 0; i < command.instance_count; i++)
+			{
+				batch_instance current;
+				current.command = c;
+				current.instance.id = static_cast<unsigned int>(i);
+				if (command.instances)
+					current.instance.transform = command.instances->item(i);
+				current.draw_id = INVALID_DRAW_ID;
+				if (visibility_buffer)
+				{
+					current.draw_id = static_cast<unsigned int>(draw_records.size());
+					draw_records.push_back(draw_record{
+							command.buffers, command.index_offset, draw_shaders.size() - 1, current.instance});
+				}
+				if (command.meshlets)
+				{
+					current.frustum = cg::world::frustum::from_matrix(mul(command.matrix, current.instance.transform));
+					current.camera_position = command.camera_position;
+					if (command.instances)
+						current.camera_position = mul(inverse(current.instance.transform), float4{command.camera_position, 1.f}).xyz();
+				}
+				batch_instances.push_back(current);
 			}
+		}
 
-			int2 vertex_a = int2(vertices[0].position.xy());
-			int2 vertex_b = int2(vertices[1].position.xy());
-			int2 vertex_c = int2(vertices[2].position.xy());
+		// Meshlets are natural units of work, plain index ranges are cut into chunks
+		batch_items.clear();
+		for (size_t i = 0; i < batch_instances.size(); i++)
+		{
+			const auto& command = commands[batch_instances[i].command];
+			if (command.meshlets)
+			{
+				statistics.meshlets += command.num_meshlets;
+				for (size_t m = 0; m < command.num_meshlets; m++)
+				{
+					const meshlet& current = command.meshlets[m];
+					batch_items.push_back(batch_item{i, current.index_offset, current.index_count, &current});
+				}
+				continue;
+			}
+			for (size_t first = 0; first < command.index_count; first += 3 * BATCH_CHUNK_TRIANGLES)
+			{
+				size_t count = std::min(3 * BATCH_CHUNK_TRIANGLES, command.index_count - first);
+				batch_items.push_back(batch_item{i, command.index_offset + first, count, nullptr});
+			}
+		}
 
-			int2 min_vertex = min(vertex_a, min(vertex_b, vertex_c));
-			int2 max_vertex = max(vertex_a, max(vertex_b, vertex_c));
+		size_t num_items = batch_items.size();
+		if (batch_triangles.size() < num_items)
+		{
+			batch_triangles.resize(num_items);
+			batch_planes.resize(num_items);
+		}
+		batch_statistics.assign(num_items, draw_statistics{});
 
-			int2 min_viewport = int2(0, 0);
-			int2 max_viewport = int2(width - 1, height - 1);
+		// Setup only reads the shared state, every item writes its own lists
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < static_cast<int>(num_items); i++)
+		{
+			const batch_item& item = batch_items[i];
+			const batch_instance& instance = batch_instances[item.instance];
+			const auto& command = commands[instance.command];
+			auto& triangles = batch_triangles[i];
+			auto& planes = batch_planes[i];
+			auto& stats = batch_statistics[i];
+			triangles.clear();
+			planes.clear();
 
-			int2 begin = clamp(min_vertex, min_viewport, max_viewport);
-			int2 end = clamp(max_vertex, min_viewport, max_viewport);
+			if (item.source_meshlet)
+			{
+				if (!instance.frustum.is_sphere_visible(item.source_meshlet->center, item.source_meshlet->radius))
+				{
+					stats.culled_meshlets_outside++;
+					continue;
+				}
+				if (is_cone_culled(*item.source_meshlet, instance.camera_position))
+				{
+					stats.culled_meshlets_facing++;
+					continue;
+				}
+			}
 
-			float edge = static_cast<float>(edge_function(vertex_a, vertex_b, vertex_c));
+			vertex_fetch<VB> fetch(command.buffers);
+			setup_triangles(
+					fetch, command.vertex_shader, command.position_shader, instance.instance,
+					item.first_vertex, item.num_vertexes, command.index_offset, instance.draw_id, stats,
+					[&](const screen_triangle& triangle, const triangle_planes<VR>& triangle_setup) {
+						stats.rasterized++;
+						triangles.push_back(triangle);
+						planes.push_back(triangle_setup);
+					});
+		}
 
-			for (int x = begin.x; x <= end.x; x++)
+		// Binning in the item order keeps the draw order inside every tile
+		tile_bins.resize(tiles_x * tiles_y);
+		for (auto& bin: tile_bins)
+			bin.clear();
+		const int tile_size = static_cast<int>(TILE_SIZE);
+		for (size_t i = 0; i < num_items; i++)
+		{
+			statistics += batch_statistics[i];
+			const auto& triangles = batch_triangles[i];
+			for (size_t t = 0; t < triangles.size(); t++)
 			{
-				for (int y = begin.y; y <= end.y; y++)
+				const screen_triangle& triangle = triangles[t];
+				for (int tile_y = triangle.begin.y / tile_size; tile_y <= triangle.end.y / tile_size; tile_y++)
 				{
-					int2 point{x, y};
-					int edge0 = edge_function(vertex_a, vertex_b, point);
-					int edge1 = edge_function(vertex_b, vertex_c, point);
-					int edge2 = edge_function(vertex_c, vertex_a, point);
-					if (edge0 >= 0 && edge1 >= 0 && edge2 >= 0)
+					for (int tile_x = triangle.begin.x / tile_size; tile_x <= triangle.end.x / tile_size; tile_x++)
 					{
-						float u = static_cast<float>(edge1) / edge;
-						float v = static_cast<float>(edge2) / edge;
-						float w = static_cast<float>(edge0) / edge;
+						tile_bins[tile_y * tiles_x + tile_x].push_back(
+								binned_triangle{static_cast<uint32_t>(i), static_cast<uint32_t>(t)});
+					}
+				}
+			}
+		}
 
-						float depth = u * vertices[0].position.z + v * vertices[1].position.z + w * vertices[2].position.z;
+		// A tile only touches its own pixels and its own hierarchical depth entry
+#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < static_cast<int>(tile_bins.size()); tile++)
+		{
+			int tile_x = tile % static_cast<int>(tiles_x);
+			int tile_y = tile / static_cast<int>(tiles_x);
+			int2 tile_begin{tile_x * tile_size, tile_y * tile_size};
+			int2 tile_end{tile_begin.x + tile_size - 1, tile_begin.y + tile_size - 1};
+			for (const binned_triangle& binned: tile_bins[tile])
+			{
+				const screen_triangle& triangle = batch_triangles[binned.item][binned.triangle];
+				int2 begin = max(triangle.begin, tile_begin);
+				int2 end = min(triangle.end, tile_end);
+				if (depth_buffer && occlusion_culling &&
+					depth_tiles.is_occluded(begin, end, triangle.min_z, depth_compare, *depth_buffer))
+					continue;
+				const auto& command = commands[batch_instances[batch_items[binned.item].instance].command];
+				rasterize_region(
+						triangle, batch_planes[binned.item][binned.triangle], begin, end,
+						command.pixel_shader ? command.pixel_shader : pixel_shader);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::draw_instanced(
+			size_t num_vertexes, size_t instance_count,
+			std::shared_ptr<resource<float4x4>> instance_buffer, size_t vertex_offset)
+	{
+		instanced_commands.resize(1);
+		draw_command<VB, VR>& command = instanced_commands[0];
+		command = instanced_command(vertex_offset, instance_count, std::move(instance_buffer));
+		command.index_count = num_vertexes;
+		draw_batch(instanced_commands);
+	}
 
-						if (depth_test(depth, x, y))
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::draw_meshlets_instanced(
+			const meshlet* meshlets, size_t num_meshlets, size_t vertex_offset,
+			const float4x4& matrix, const float3& camera_position,
+			size_t instance_count, std::shared_ptr<resource<float4x4>> instance_buffer)
+	{
+		instanced_commands.resize(1);
+		draw_command<VB, VR>& command = instanced_commands[0];
+		command = instanced_command(vertex_offset, instance_count, std::move(instance_buffer));
+		command.meshlets = meshlets;
+		command.num_meshlets = num_meshlets;
+		command.matrix = matrix;
+		command.camera_position = camera_position;
+		draw_batch(instanced_commands);
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline draw_command<VB, VR> rasterizer<VB, RT, VR>::instanced_command(
+			size_t vertex_offset, size_t instance_count, std::shared_ptr<resource<float4x4>> instance_buffer) const
+	{
+		draw_command<VB, VR> command;
+		command.buffers = buffers;
+		command.index_offset = vertex_offset;
+		command.instances = std::move(instance_buffer);
+		command.instance_count = instance_count;
+		command.vertex_shader = vertex_shader;
+		command.position_shader = position_shader;
+		command.pixel_shader = pixel_shader;
+		return command;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline bool rasterizer<VB, RT, VR>::is_cone_culled(const meshlet& meshlet, const float3& camera_position) const
+	{
+		if (culling == cull_mode::none || meshlet.cone_cutoff <= 0.f)
+			return false;
+
+		// Every triangle faces away when the angle between the axis and the view
+		// direction, plus the cone angle, plus the angle the sphere covers stays
+		// below 90 degrees
+		float3 axis = culling == cull_mode::back ? meshlet.cone_axis : -meshlet.cone_axis;
+		float3 to_center = meshlet.center - camera_position;
+		float distance2 = length2(to_center);
+		float radius2 = meshlet.radius * meshlet.radius;
+		if (distance2 <= radius2)
+			return false;
+		float tangent_length = std::sqrt(distance2 - radius2);
+		float cone_cos = meshlet.cone_cutoff;
+		float cone_sin = std::sqrt(std::max(0.f, 1.f - cone_cos * cone_cos));
+		if (cone_cos * tangent_length <= cone_sin * meshlet.radius)
+			return false;
+		return dot(axis, to_center) > cone_sin * tangent_length + cone_cos * meshlet.radius;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::draw_triangles(
+			size_t first_vertex, size_t num_vertexes, size_t vertex_offset, unsigned int draw_id)
+	{
+		vertex_fetch<VB> fetch(buffers);
+		setup_triangles(
+				fetch, vertex_shader, position_shader, vertex_instance{},
+				first_vertex, num_vertexes, vertex_offset, draw_id, statistics,
+				[&](const screen_triangle& triangle, const triangle_planes<VR>& planes) {
+					// No pixel can be closer than the nearest corner of the bounds
+					if (depth_buffer && occlusion_culling &&
+						depth_tiles.is_occluded(triangle.begin, triangle.end, triangle.min_z, depth_compare, *depth_buffer))
+					{
+						statistics.culled_occluded++;
+						return;
+					}
+					statistics.rasterized++;
+					rasterize_region(triangle, planes, triangle.begin, triangle.end, pixel_shader);
+				});
+	}
+
+	template<typename VB, typename RT, typename VR>
+	template<typename Emit>
+	inline void rasterizer<VB, RT, VR>::setup_triangles(
+			const vertex_fetch<VB>& fetch, const vertex_shader_type& in_vertex_shader,
+			const position_shader_type& in_position_shader, const vertex_instance& instance,
+			size_t first_vertex, size_t num_vertexes, size_t vertex_offset, unsigned int draw_id,
+			draw_statistics& stats, Emit&& emit) const
+	{
+		// Varyings are only interpolated when colors are shaded right away
+		bool positions_only = in_position_shader && (!color_write || visibility_buffer);
+
+		// The post-transform cache lives for one call, which covers a single
+		// instance, so its entries are keyed by the instance and the index
+		unsigned int cached_indices[POST_TRANSFORM_CACHE_SIZE];
+		float4 cached_clip[POST_TRANSFORM_CACHE_SIZE];
+		VR cached_attributes[POST_TRANSFORM_CACHE_SIZE];
+		size_t cache_size = 0;
+		size_t cache_head = 0;
+
+		size_t vertex_id = first_vertex;
+		while (vertex_id < first_vertex + num_vertexes)
+		{
+			unsigned int triangle_id = static_cast<unsigned int>((vertex_id - vertex_offset) / 3);
+			stats.triangles++;
+
+			float4 clip[3];
+			VR attributes[3];
+			for (size_t i = 0; i < 3; i++)
+			{
+				unsigned int index = fetch.index(vertex_id++);
+				size_t entry = 0;
+				while (entry < cache_size && cached_indices[entry] != index)
+					entry++;
+				if (entry < cache_size)
+				{
+					clip[i] = cached_clip[entry];
+					if (!positions_only)
+						attributes[i] = cached_attributes[entry];
+					continue;
+				}
+
+				stats.shaded_vertices++;
+				if (positions_only)
+				{
+					clip[i] = in_position_shader(fetch.position(index), instance);
+				}
+				else
+				{
+					auto processed_vertex = in_vertex_shader(fetch.position(index), fetch.vertex(index), instance);
+					clip[i] = processed_vertex.first;
+					attributes[i] = processed_vertex.second;
+					cached_attributes[cache_head] = attributes[i];
+				}
+				cached_indices[cache_head] = index;
+				cached_clip[cache_head] = clip[i];
+				cache_head = (cache_head + 1) % POST_TRANSFORM_CACHE_SIZE;
+				cache_size = std::min(cache_size + 1, POST_TRANSFORM_CACHE_SIZE);
+			}
+
+			// Clip space z is in [0, w], so z < 0 is in front of the near plane or behind the camera
+			int num_behind = (clip[0].z < 0.f) + (clip[1].z < 0.f) + (clip[2].z < 0.f);
+			if (num_behind == 3)
+			{
+				stats.culled_outside++;
+				continue;
+			}
+
+			// The planes are only set up once a part of the triangle passed the screen
+			// tests, which reject about half of a closed mesh by their facing alone
+			screen_triangle triangle;
+			triangle_planes<VR> planes;
+			bool planes_ready = false;
+			bool planes_failed = false;
+			auto emit_part = [&](const float4 (&part)[3]) {
+				if (planes_failed || !setup_screen_triangle(part, draw_id, triangle_id, triangle, stats))
+					return;
+				if (!planes_ready)
+				{
+					if (!setup_planes(clip, positions_only ? nullptr : attributes, planes))
+					{
+						planes_failed = true;
+						stats.culled_zero_area++;
+						return;
+					}
+					planes_ready = true;
+				}
+				setup_min_depth(triangle, planes);
+				emit(triangle, planes);
+			};
+
+			if (num_behind == 0)
+			{
+				emit_part(clip);
+				continue;
+			}
+
+			// Clip against the near plane, the planes of the whole triangle serve every part
+			stats.clipped++;
+			float4 polygon[4];
+			size_t polygon_size = 0;
+			for (size_t i = 0; i < 3; i++)
+			{
+				const float4& current = clip[i];
+				const float4& next = clip[(i + 1) % 3];
+				if (current.z >= 0.f)
+					polygon[polygon_size++] = current;
+				if ((current.z >= 0.f) != (next.z >= 0.f))
+				{
+					float t = current.z / (current.z - next.z);
+					polygon[polygon_size++] = current + (next - current) * t;
+				}
+			}
+			for (size_t i = 1; i + 1 < polygon_size; i++)
+			{
+				float4 part[3] = {polygon[0], polygon[i], polygon[i + 1]};
+				emit_part(part);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline bool rasterizer<VB, RT, VR>::setup_planes(
+			const float4 (&clip)[3], const VR* attributes,
+			triangle_planes<VR>& planes) const
+	{
+		// Homogeneous screen positions (x * w, y * w, w) of the vertices
+		float half_width = static_cast<float>(width) / 2.f;
+		float half_height = static_cast<float>(height) / 2.f;
+		float3 screen[3];
+		for (size_t i = 0; i < 3; i++)
+		{
+			screen[i] = float3{
+					(clip[i].x + clip[i].w) * half_width,
+					(clip[i].w - clip[i].y) * half_height,
+					clip[i].w};
+		}
+
+		// Rows of the inverse of the matrix with the screen positions as columns,
+		// dotted with (x, y, 1) they give the barycentrics divided by w
+		float3 rows[3] = {
+				cross(screen[1], screen[2]),
+				cross(screen[2], screen[0]),
+				cross(screen[0], screen[1])};
+		float determinant = dot(screen[0], rows[0]);
+		if (std::abs(determinant) < std::numeric_limits<float>::min())
+			return false;
+
+		float inv_determinant = 1.f / determinant;
+		for (auto& row: rows)
+		{
+			row *= inv_determinant;
+		}
+
+		planes.inv_w = rows[0] + rows[1] + rows[2];
+		planes.depth = rows[0] * clip[0].z + rows[1] * clip[1].z + rows[2] * clip[2].z;
+		if (!attributes)
+			return true;
+		for (size_t i = 0; i < VR::size; i++)
+		{
+			float3 plane = rows[0] * attributes[0].values[i] +
+						   rows[1] * attributes[1].values[i] +
+						   rows[2] * attributes[2].values[i];
+			planes.a[i] = plane.x;
+			planes.b[i] = plane.y;
+			planes.c[i] = plane.z;
+		}
+		return true;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline bool rasterizer<VB, RT, VR>::setup_screen_triangle(
+			const float4 (&clip)[3], unsigned int draw_id, unsigned int triangle_id,
+			screen_triangle& triangle, draw_statistics& stats) const
+	{
+		float3 positions[3];
+		for (size_t i = 0; i < 3; i++)
+		{
+			positions[i] = clip[i].xyz() / clip[i].w;
+			positions[i].x = (positions[i].x + 1.f) * width / 2.f;
+			positions[i].y = (-positions[i].y + 1.f) * height / 2.f;
+		}
+
+		// Multisampling rounds to the sub-pixel grid, single samples truncate to whole pixels.
+		// Vertices far off the screen but in front of the near plane are clamped first, which
+		// only bends triangles that reach millions of pixels out.
+		int subpixel_scale = samples > 1 ? SUBPIXEL_SCALE : 1;
+		auto snap = [&](const float3& position) {
+			float2 guarded = clamp(position.xy(), float2(-GUARD_BAND), float2(GUARD_BAND));
+			if (samples == 1)
+				return int2(guarded);
+			float2 scaled = guarded * static_cast<float>(SUBPIXEL_SCALE);
+			return int2(static_cast<int>(std::floor(scaled.x + 0.5f)), static_cast<int>(std::floor(scaled.y + 0.5f)));
+		};
+		int2 vertex_a = snap(positions[0]);
+		int2 vertex_b = snap(positions[1]);
+		int2 vertex_c = snap(positions[2]);
+
+		// Pixels whose samples the bounds may cover
+		auto to_pixel = [subpixel_scale](int v) {
+			return v >= 0 ? v / subpixel_scale : -((-v + subpixel_scale - 1) / subpixel_scale);
+		};
+		int2 min_snapped = min(vertex_a, min(vertex_b, vertex_c));
+		int2 max_snapped = max(vertex_a, max(vertex_b, vertex_c));
+		int2 min_vertex{to_pixel(min_snapped.x), to_pixel(min_snapped.y)};
+		int2 max_vertex{to_pixel(max_snapped.x), to_pixel(max_snapped.y)};
+
+		int2 min_viewport = int2(0, 0);
+		int2 max_viewport = int2(width - 1, height - 1);
+
+		if (max_vertex.x < min_viewport.x || max_vertex.y < min_viewport.y ||
+			min_vertex.x > max_viewport.x || min_vertex.y > max_viewport.y)
+		{
+			stats.culled_outside++;
+			return false;
+		}
+
+		// The signed area is positive for counter-clockwise (front-facing) triangles
+		int64_t signed_area = edge_function(vertex_a, vertex_b, vertex_c);
+		if (signed_area == 0)
+		{
+			// Triangles with a non-zero area that collapse after snapping are smaller than a pixel
+			float2 ba = positions[1].xy() - positions[0].xy();
+			float2 ca = positions[2].xy() - positions[0].xy();
+			if (std::abs(ba.x * ca.y - ba.y * ca.x) > std::numeric_limits<float>::epsilon())
+				stats.culled_small++;
+			else
+				stats.culled_zero_area++;
+			return false;
+		}
+
+		bool back_facing = signed_area < 0;
+		if ((culling == cull_mode::back && back_facing) ||
+			(culling == cull_mode::front && !back_facing))
+		{
+			stats.culled_facing++;
+			return false;
+		}
+
+		// Rewind back-facing triangles so the coverage test stays the same
+		if (back_facing)
+		{
+			std::swap(vertex_b, vertex_c);
+		}
+		triangle.vertices[0] = vertex_a;
+		triangle.vertices[1] = vertex_b;
+		triangle.vertices[2] = vertex_c;
+		triangle.begin = clamp(min_vertex, min_viewport, max_viewport);
+		triangle.end = clamp(max_vertex, min_viewport, max_viewport);
+		triangle.draw_id = draw_id;
+		triangle.triangle_id = triangle_id;
+		return true;
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::setup_min_depth(
+			screen_triangle& triangle, const triangle_planes<VR>& planes) const
+	{
+		// The depth is sampled at the snapped pixels, which may lie a bit outside of
+		// the triangle, so the nearest depth is taken at the corners of the bounds
+		// where the linear depth is extreme. The samples of a multisampled pixel
+		// spread over all of its area.
+		float sample_extent = samples > 1 ? 1.f : 0.f;
+		triangle.min_z = std::numeric_limits<float>::max();
+		for (int corner = 0; corner < 4; corner++)
+		{
+			float x = corner & 1 ? static_cast<float>(triangle.end.x) + sample_extent : static_cast<float>(triangle.begin.x);
+			float y = corner & 2 ? static_cast<float>(triangle.end.y) + sample_extent : static_cast<float>(triangle.begin.y);
+			triangle.min_z = std::min(triangle.min_z, planes.get_depth(x, y));
+		}
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::rasterize_region(
+			const screen_triangle& triangle, const triangle_planes<VR>& planes, int2 begin, int2 end,
+			const pixel_shader_type& shader)
+	{
+		if (samples > 1)
+		{
+			rasterize_multisampled_region(triangle, planes, begin, end, shader);
+			return;
+		}
+
+		const int2& vertex_a = triangle.vertices[0];
+		const int2& vertex_b = triangle.vertices[1];
+		const int2& vertex_c = triangle.vertices[2];
+		unsigned int draw_id = triangle.draw_id;
+		unsigned int triangle_id = triangle.triangle_id;
+
+		// Top-left fill rule: a pixel exactly on an edge shared by two triangles belongs
+		// to the one it's a top or left edge of, so no pixel is covered twice
+		auto edge_bias = [](const int2& from, const int2& to) {
+			int dx = to.x - from.x;
+			int dy = to.y - from.y;
+			return dy > 0 || (dy == 0 && dx < 0) ? 0 : -1;
+		};
+		int bias0 = edge_bias(vertex_a, vertex_b);
+		int bias1 = edge_bias(vertex_b, vertex_c);
+		int bias2 = edge_bias(vertex_c, vertex_a);
+
+		// Walk the bounding box tile by tile, so that every tile of the buffers is
+		// finished before the next one, whatever their layout
+		VR interpolated, ddx, ddy;
+		const int tile_size = static_cast<int>(TILE_SIZE);
+		for (int tile_y = begin.y / tile_size; tile_y <= end.y / tile_size; tile_y++)
+		{
+			for (int tile_x = begin.x / tile_size; tile_x <= end.x / tile_size; tile_x++)
+			{
+				RT* color_tile = render_target ? render_target->tile(tile_x, tile_y) : nullptr;
+				float* depth_tile = depth_buffer ? depth_buffer->tile(tile_x, tile_y) : nullptr;
+				visibility_sample* visibility_tile = visibility_buffer ? visibility_buffer->tile(tile_x, tile_y) : nullptr;
+				bool weighted = color_write && blending == blend_mode::weighted;
+				float4* accumulation_tile = weighted ? accumulation_buffer->tile(tile_x, tile_y) : nullptr;
+				float* revealage_tile = weighted ? revealage_buffer->tile(tile_x, tile_y) : nullptr;
+
+				int tile_end_y = std::min(end.y, (tile_y + 1) * tile_size - 1);
+				int tile_end_x = std::min(end.x, (tile_x + 1) * tile_size - 1);
+				for (int y = std::max(begin.y, tile_y * tile_size); y <= tile_end_y; y++)
+				{
+					size_t local_y = y - tile_y * tile_size;
+					for (int x = std::max(begin.x, tile_x * tile_size); x <= tile_end_x; x++)
+					{
+						int2 point{x, y};
+						int64_t edge0 = edge_function(vertex_a, vertex_b, point);
+						int64_t edge1 = edge_function(vertex_b, vertex_c, point);
+						int64_t edge2 = edge_function(vertex_c, vertex_a, point);
+						if (edge0 + bias0 < 0 || edge1 + bias1 < 0 || edge2 + bias2 < 0)
+							continue;
+
+						float sample_x = static_cast<float>(x);
+						float sample_y = static_cast<float>(y);
+						float depth = planes.get_depth(sample_x, sample_y);
+
+						size_t local_x = x - tile_x * tile_size;
+						prepare_tile(x, y);
+						float* stored_depth = depth_tile ? &depth_tile[depth_buffer->tile_offset(local_x, local_y)] : nullptr;
+						if (stored_depth && !depth_test(depth, *stored_depth))
+							continue;
+
+						if (weighted)
+						{
+							// Weight of McGuire and Bavoil, falling off with the view depth so
+							// that the nearer surfaces dominate the average
+							planes.interpolate(sample_x, sample_y, interpolated, ddx, ddy);
+							auto pixel_result = shader(interpolated, ddx, ddy, depth, point);
+							float view_depth = planes.get_view_depth(sample_x, sample_y);
+							float falloff = 1e-5f + std::pow(view_depth / 5.f, 2.f) + std::pow(view_depth / 200.f, 6.f);
+							float weight = blend_alpha * std::clamp(10.f / falloff, 1e-2f, 3e3f);
+							accumulation_tile[accumulation_buffer->tile_offset(local_x, local_y)] +=
+									float4{pixel_result.to_float3() * blend_alpha, blend_alpha} * weight;
+							revealage_tile[revealage_buffer->tile_offset(local_x, local_y)] *= 1.f - blend_alpha;
+							continue;
+						}
+						if (color_write && visibility_tile)
+						{
+							visibility_tile[visibility_buffer->tile_offset(local_x, local_y)] =
+									visibility_sample{draw_id, triangle_id};
+						}
+						else if (color_write)
+						{
+							planes.interpolate(sample_x, sample_y, interpolated, ddx, ddy);
+							auto pixel_result = shader(interpolated, ddx, ddy, depth, point);
+							color_tile[render_target->tile_offset(local_x, local_y)] = RT::from_color(pixel_result);
+						}
+						if (stored_depth)
+						{
+							*stored_depth = depth;
+							depth_tiles.update(x, y);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VR>
+	inline void rasterizer<VB, RT, VR>::rasterize_multisampled_region(
+			const screen_triangle& triangle, const triangle_planes<VR>& planes, int2 begin, int2 end,
+			const pixel_shader_type& shader)
+	{
+		const int2& vertex_a = triangle.vertices[0];
+		const int2& vertex_b = triangle.vertices[1];
+		const int2& vertex_c = triangle.vertices[2];
+
+		// The edge functions are evaluated at the pixel centers and stepped to the
+		// samples, with the top-left fill rule of the single sampled coverage
+		const int2* edge_vertices[3][2] = {{&vertex_a, &vertex_b}, {&vertex_b, &vertex_c}, {&vertex_c, &vertex_a}};
+		int64_t step_x[3];
+		int64_t step_y[3];
+		int64_t bias[3];
+		for (size_t edge = 0; edge < 3; edge++)
+		{
+			const int2& from = *edge_vertices[edge][0];
+			const int2& to = *edge_vertices[edge][1];
+			step_x[edge] = to.y - from.y;
+			step_y[edge] = from.x - to.x;
+			bias[edge] = step_x[edge] > 0 || (step_x[edge] == 0 && step_y[edge] > 0) ? 0 : -1;
+		}
+		const int(*pattern)[2] = samples == 8 ? MSAA_8X_PATTERN : MSAA_4X_PATTERN;
+		int64_t sample_steps[8][3];
+		float2 sample_offsets[8];
+		for (size_t sample = 0; sample < samples; sample++)
+		{
+			for (size_t edge = 0; edge < 3; edge++)
+				sample_steps[sample][edge] = pattern[sample][0] * step_x[edge] + pattern[sample][1] * step_y[edge] + bias[edge];
+			sample_offsets[sample] = float2{
+					0.5f + static_cast<float>(pattern[sample][0]) / SUBPIXEL_SCALE,
+					0.5f + static_cast<float>(pattern[sample][1]) / SUBPIXEL_SCALE};
+		}
+
+		bool weighted = color_write && blending == blend_mode::weighted;
+		VR interpolated, ddx, ddy;
+		float sample_z[8];
+		const int tile_size = static_cast<int>(TILE_SIZE);
+		for (int tile_y = begin.y / tile_size; tile_y <= end.y / tile_size; tile_y++)
+		{
+			for (int tile_x = begin.x / tile_size; tile_x <= end.x / tile_size; tile_x++)
+			{
+				float* depth_tile = depth_buffer ? depth_buffer->tile(tile_x, tile_y) : nullptr;
+				float4* accumulation_tile = weighted ? accumulation_buffer->tile(tile_x, tile_y) : nullptr;
+				float* revealage_tile = weighted ? revealage_buffer->tile(tile_x, tile_y) : nullptr;
+
+				int tile_end_y = std::min(end.y, (tile_y + 1) * tile_size - 1);
+				int tile_end_x = std::min(end.x, (tile_x + 1) * tile_size - 1);
+				for (int y = std::max(begin.y, tile_y * tile_size); y <= tile_end_y; y++)
+				{
+					size_t local_y = y - tile_y * tile_size;
+					for (int x = std::max(begin.x, tile_x * tile_size); x <= tile_end_x; x++)
+					{
+						int2 center{x * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2, y * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2};
+						int64_t edges[3] = {
+								edge_function(vertex_a, vertex_b, center),
+								edge_function(vertex_b, vertex_c, center),
+								edge_function(vertex_c, vertex_a, center)};
+						unsigned int covered = 0;
+						for (size_t sample = 0; sample < samples; sample++)
+						{
+							const int64_t* steps = sample_steps[sample];
+							if (edges[0] + steps[0] >= 0 && edges[1] + steps[1] >= 0 && edges[2] + steps[2] >= 0)
+								covered |= 1u << sample;
+						}
+						if (!covered)
+							continue;
+
+						prepare_tile(x, y);
+						size_t first_sample = static_cast<size_t>(x) * samples;
+						unsigned int passed = 0;
+						size_t num_passed = 0;
+						for (size_t sample = 0; sample < samples; sample++)
 						{
-							auto pixel_result = pixel_shader(vertices[0], depth);
-							render_target->item(x, y) = RT::from_color(pixel_result);
-							depth_buffer->item(x, y) = depth;
+							if (!(covered & (1u << sample)))
+								continue;
+							float2 position = float2{static_cast<float>(x), static_cast<float>(y)} + sample_offsets[sample];
+							sample_z[sample] = planes.get_depth(position.x, position.y);
+							if (sample_depths && !depth_test(sample_z[sample], sample_depths->item(first_sample + sample, y)))
+								continue;
+							passed |= 1u << sample;
+							num_passed++;
 						}
+						if (!passed)
+							continue;
 
-						
+						// Shaded once at the pixel center, even when the center itself isn't covered
+						size_t local_x = x - tile_x * tile_size;
+						float center_x = static_cast<float>(x) + 0.5f;
+						float center_y = static_cast<float>(y) + 0.5f;
+						if (weighted)
+						{
+							// Partly covered pixels blend with the covered fraction as the exponent of
+							// the revealage and a factor of the accumulation, so the triangles sharing
+							// a pixel add up to one fully covering surface without seams
+							planes.interpolate(center_x, center_y, interpolated, ddx, ddy);
+							auto pixel_result = shader(interpolated, ddx, ddy, planes.get_depth(center_x, center_y), int2{x, y});
+							float coverage = static_cast<float>(num_passed) / static_cast<float>(samples);
+							float view_depth = planes.get_view_depth(center_x, center_y);
+							float falloff = 1e-5f + std::pow(view_depth / 5.f, 2.f) + std::pow(view_depth / 200.f, 6.f);
+							float weight = coverage * blend_alpha * std::clamp(10.f / falloff, 1e-2f, 3e3f);
+							accumulation_tile[accumulation_buffer->tile_offset(local_x, local_y)] +=
+									float4{pixel_result.to_float3() * blend_alpha, blend_alpha} * weight;
+							float& revealage = revealage_tile[revealage_buffer->tile_offset(local_x, local_y)];
+							revealage *= num_passed == samples ? 1.f - blend_alpha : std::pow(1.f - blend_alpha, coverage);
+							continue;
+						}
+						if (color_write)
+						{
+							planes.interpolate(center_x, center_y, interpolated, ddx, ddy);
+							auto pixel_result = shader(interpolated, ddx, ddy, planes.get_depth(center_x, center_y), int2{x, y});
+							RT color = RT::from_color(pixel_result);
+							for (size_t sample = 0; sample < samples; sample++)
+							{
+								if (passed & (1u << sample))
+									sample_colors->item(first_sample + sample, y) = color;
+							}
+						}
+						if (sample_depths)
+						{
+							float farthest = std::numeric_limits<float>::lowest();
+							for (size_t sample = 0; sample < samples; sample++)
+							{
+								float& stored = sample_depths->item(first_sample + sample, y);
+								if (passed & (1u << sample))
+									stored = sample_z[sample];
+								farthest = std::max(farthest, stored);
+							}
+							if (depth_tile)
+							{
+								depth_tile[depth_buffer->tile_offset(local_x, local_y)] = farthest;
+								depth_tiles.update(x, y);
+							}
+						}
 					}
-					
 				}
 			}
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline int
-	rasterizer<VB, RT>::edge_function(int2 a, int2 b, int2 c)
+	template<typename VB, typename RT, typename VR>
+	inline int64_t
+	rasterizer<VB, RT, VR>::edge_function(int2 a, int2 b, int2 c) const
 	{
-		return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
+		return static_cast<int64_t>(c.x - a.x) * (b.y - a.y) - static_cast<int64_t>(c.y - a.y) * (b.x - a.x);
 	}
 
-	template<typename VB, typename RT>
-	inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+	template<typename VB, typename RT, typename VR>
+	inline bool rasterizer<VB, RT, VR>::depth_test(float z, float stored_z) const
 	{
-		if (!depth_buffer)
+		if (depth_compare == depth_function::less_equal)
+			return stored_z >= z;
+		return stored_z > z;
+	}
+
+	inline void hierarchical_depth::resize(size_t in_width, size_t in_height)
+	{
+		width = in_width;
+		height = in_height;
+		tiles_x = (width + tile_size - 1) / tile_size;
+		tiles_y = (height + tile_size - 1) / tile_size;
+
+		max_depth.assign(tiles_x * tiles_y, DEFAULT_DEPTH);
+		dirty.assign(tiles_x * tiles_y, 0);
+	}
+
+	inline void hierarchical_depth::clear(float in_depth)
+	{
+		std::fill(max_depth.begin(), max_depth.end(), in_depth);
+		std::fill(dirty.begin(), dirty.end(), 0);
+	}
+
+	inline void hierarchical_depth::update(size_t x, size_t y)
+	{
+		size_t tile = (y / tile_size) * tiles_x + x / tile_size;
+		dirty[tile] = 1;
+	}
+
+	inline bool hierarchical_depth::is_occluded(
+			int2 begin, int2 end, float min_z, depth_function function,
+			resource<float>& depth_buffer)
+	{
+		for (size_t tile_y = begin.y / tile_size; tile_y <= end.y / tile_size; tile_y++)
 		{
-			return true;
+			for (size_t tile_x = begin.x / tile_size; tile_x <= end.x / tile_size; tile_x++)
+			{
+				float tile_max = get_max_depth(tile_x, tile_y, depth_buffer);
+				bool may_pass = function == depth_function::less_equal ? min_z <= tile_max : min_z < tile_max;
+				if (may_pass)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	inline float hierarchical_depth::get_max_depth(
+			size_t tile_x, size_t tile_y, resource<float>& depth_buffer)
+	{
+		size_t tile = tile_y * tiles_x + tile_x;
+		if (dirty[tile])
+		{
+			float tile_max = std::numeric_limits<float>::lowest();
+			const float* depth_tile = depth_buffer.tile(tile_x, tile_y);
+			size_t tile_width = std::min(width, (tile_x + 1) * tile_size) - tile_x * tile_size;
+			size_t tile_height = std::min(height, (tile_y + 1) * tile_size) - tile_y * tile_size;
+			for (size_t local_y = 0; local_y < tile_height; local_y++)
+			{
+				for (size_t local_x = 0; local_x < tile_width; local_x++)
+				{
+					tile_max = std::max(tile_max, depth_tile[depth_buffer.tile_offset(local_x, local_y)]);
+				}
+			}
+			max_depth[tile] = tile_max;
+			dirty[tile] = 0;
 		}
-		return depth_buffer->item(x, y) > z;
+		return max_depth[tile];
 	}
 
 }// namespace cg::renderer
\ No newline at end of file
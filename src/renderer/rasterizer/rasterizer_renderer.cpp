@@ -1,37 +1,107 @@
 #include "rasterizer_renderer.h"
+#include "utils/error_handler.h"
+#include "utils/noise.h"
 #include "utils/resource_utils.h"
 
-#include <random>
-#include <ctime>
-
-// Modify the pixel_shader function in rasterization_renderer.cpp
-
-// Add these includes at the top of the file
-#include <random>
-#include <ctime>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
 
 void cg::renderer::rasterization_renderer::init()
 {
-    rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
+    rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex_attributes, cg::unsigned_color4, shading_varyings>>();
     rasterizer->set_viewport(settings->width, settings->height);
-    render_target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
 
-    depth_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height);
-    
-    // Add a new buffer to store the original color values for blending
-    original_color_buffer = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
+    // Large framebuffers get transparent huge pages to cut the TLB misses
+    cg::resource_allocation framebuffer_allocation;
+    framebuffer_allocation.huge_pages = true;
+    if (settings->framebuffer_layout == "linear")
+        framebuffer_allocation.layout = cg::resource_layout::linear;
+    else if (settings->framebuffer_layout == "tiled")
+        framebuffer_allocation.layout = cg::resource_layout::tiled;
+    else if (settings->framebuffer_layout == "morton")
+        framebuffer_allocation.layout = cg::resource_layout::morton;
+    else
+        THROW_ERROR("Unknown framebuffer layout: " + settings->framebuffer_layout);
+    render_target = std::make_shared<cg::resource<cg::unsigned_color4>>(settings->width, settings->height, framebuffer_allocation);
+
+    depth_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height, framebuffer_allocation);
 
     rasterizer->set_render_target(render_target, depth_buffer);
 
+    if (settings->msaa != 1 && settings->msaa != 4 && settings->msaa != 8)
+        THROW_ERROR("Unsupported MSAA sample count: " + std::to_string(settings->msaa));
+    if (settings->msaa > 1)
+    {
+        sample_colors = std::make_shared<cg::resource<cg::unsigned_color4>>(settings->width * settings->msaa, settings->height, framebuffer_allocation);
+        sample_depths = std::make_shared<cg::resource<float>>(settings->width * settings->msaa, settings->height, framebuffer_allocation);
+        rasterizer->set_multisample_targets(sample_colors, sample_depths, settings->msaa);
+    }
+
+    // Transparent surfaces all blend in the pixel, which leaves no single visible one to store
+    if (settings->transparency == "weighted")
+        weighted_transparency = settings->alpha < 1.f;
+    else if (settings->transparency != "background")
+        THROW_ERROR("Unknown transparency: " + settings->transparency);
+    if (weighted_transparency)
+    {
+        accumulation_buffer = std::make_shared<cg::resource<float4>>(settings->width, settings->height, framebuffer_allocation);
+        revealage_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height, framebuffer_allocation);
+        rasterizer->set_transparency_buffers(accumulation_buffer, revealage_buffer);
+        if (settings->visibility_buffer || settings->depth_prepass)
+            std::cout << "Weighted transparency draws without the visibility buffer and the depth prepass\n";
+    }
+    else if (settings->visibility_buffer && settings->msaa > 1)
+    {
+        // The visibility buffer stores one triangle per pixel, not per sample
+        std::cout << "Multisampling draws without the visibility buffer\n";
+    }
+    else if (settings->visibility_buffer)
+    {
+        visibility_buffer = std::make_shared<cg::resource<cg::renderer::visibility_sample>>(settings->width, settings->height, framebuffer_allocation);
+        rasterizer->set_visibility_buffer(visibility_buffer);
+    }
+    rasterizer->set_occlusion_culling(settings->occlusion_culling);
+
+    if (settings->cull_mode == "none")
+        rasterizer->set_cull_mode(cg::renderer::cull_mode::none);
+    else if (settings->cull_mode == "front")
+        rasterizer->set_cull_mode(cg::renderer::cull_mode::front);
+    else if (settings->cull_mode == "back")
+        rasterizer->set_cull_mode(cg::renderer::cull_mode::back);
+    else
+        THROW_ERROR("Unknown cull mode: " + settings->cull_mode);
+
     model = std::make_shared<cg::world::model>();
-    model->load_obj(settings->model_path);
+    model->load_obj(settings->model_path, settings->mesh_cache, settings->mesh_optimization, settings->lod_levels);
+    if (settings->mesh_compression)
+        model->compress();
+
+    texture_filter = cg::world::parse_texture_filter(settings->texture_filter);
+    // Textures decode in the background while the rest of the frame is set up
+    if (settings->textures)
+    {
+        texture_streamer = std::make_shared<cg::world::texture_streamer>(size_t{settings->texture_budget} << 20);
+        texture_streamer->prefetch(model->get_per_shape_texture_files());
+    }
 
     for (size_t i=0; i<model->get_index_buffers().size(); i++)
     {
-        auto index_buffer_size = model->get_index_buffers()[i]->size_bytes();
-        auto vertex_buffer_size = model->get_vertex_buffers()[i]->size_bytes();
+        size_t index_buffer_size;
+        size_t vertex_buffer_size;
+        if (model->is_compressed())
+        {
+            index_buffer_size = model->get_index_buffers()[i] ? model->get_index_buffers()[i]->size_bytes() : model->get_short_index_buffers()[i]->size_bytes();
+            vertex_buffer_size = model->get_quantized_position_buffers()[i]->size_bytes() + model->get_packed_attribute_buffers()[i]->size_bytes();
+        }
+        else
+        {
+            index_buffer_size = model->get_index_buffers()[i]->size_bytes();
+            vertex_buffer_size = model->get_position_buffers()[i]->size_bytes() + model->get_attribute_buffers()[i]->size_bytes();
+        }
 
-        auto pure_vertex_buffer_size = model->get_index_buffers()[i]->count() * sizeof(cg::vertex);
+        auto pure_vertex_buffer_size = model->get_index_count(i) * (sizeof(float3) + sizeof(cg::vertex_attributes));
 
         std::cout << "Vertex buffer size: " << vertex_buffer_size << " bytes\n";
         std::cout << "Index buffer size: " << index_buffer_size << " bytes\n";
@@ -39,6 +109,32 @@ void cg::renderer::rasterization_renderer::init()
         std::cout << "Saving: " << pure_vertex_buffer_size - vertex_buffer_size - index_buffer_size << " bytes\n";
     }
 
+    // Copies of the model stand on a grid going away from the camera, spaced by the model size
+    float3 model_min{std::numeric_limits<float>::max()};
+    float3 model_max{std::numeric_limits<float>::lowest()};
+    for (const auto& bounds : model->get_per_shape_bounds())
+    {
+        model_min = min(model_min, bounds.aabb_min);
+        model_max = max(model_max, bounds.aabb_max);
+    }
+    float spacing = 1.25f * std::max(model_max.x - model_min.x, model_max.z - model_min.z);
+    size_t columns = static_cast<size_t>(std::ceil(std::sqrt(static_cast<float>(std::max(settings->instance_count, 1u)))));
+    instance_transforms.clear();
+    for (size_t i = 0; i < std::max(settings->instance_count, 1u); i++)
+    {
+        float x = (static_cast<float>(i % columns) - static_cast<float>(columns - 1) / 2.f) * spacing;
+        float z = -static_cast<float>(i / columns) * spacing;
+        instance_transforms.push_back(float4x4{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {x, 0, z, 1}});
+    }
+    // Room for all the copies in every level of every shape, render() refills the visible ones
+    instance_buffers.clear();
+    if (instance_transforms.size() > 1)
+    {
+        instance_buffers.resize(model->get_index_buffers().size() * cg::world::MAX_LOD_LEVELS);
+        for (auto& buffer : instance_buffers)
+            buffer = std::make_shared<cg::resource<float4x4>>(instance_transforms.size());
+    }
+
     camera = std::make_shared<cg::world::camera>();
     camera->set_height(static_cast<float>(settings->height));
     camera->set_width(static_cast<float>(settings->width));
@@ -63,9 +159,6 @@ void cg::renderer::rasterization_renderer::init()
     noise_frequency = settings->noise_frequency;
     std::cout << "Using noise amplitude: " << noise_amplitude << std::endl;
     std::cout << "Using noise frequency: " << noise_frequency << std::endl;
-    
-    // Seed the random number generator
-    random_generator.seed(static_cast<unsigned int>(std::time(nullptr)));
 }
 
 void cg::renderer::rasterization_renderer::render()
@@ -79,82 +172,368 @@ void cg::renderer::rasterization_renderer::render()
     std::cout << camera->get_projection_matrix() << std::endl;
     std::cout << camera->get_view_matrix() << std::endl;
 
-    rasterizer->vertex_shader = [&](float4 vertex, cg::vertex vertex_data) {
-        float4 processed = mul(matrix, vertex);
-        return std::make_pair(processed, vertex_data);
-    };
-
     // First render: clear to background color
     auto start = std::chrono::high_resolution_clock::now();
-    rasterizer->clear_render_target({111, 15, 112});
-    
-    // Store the background color
-    for (size_t i = 0; i < render_target->count(); i++) {
-        original_color_buffer->item(i) = render_target->item(i);
-    }
-    
+    rasterizer->clear_render_target(clear_color);
     auto stop = std::chrono::high_resolution_clock::now();
     std::chrono::duration<float, std::milli> duration = stop - start;
     std::cout << "Clearing took " << duration.count() << "ms\n";
 
-    // Distribution for generating random noise
-    std::uniform_real_distribution<float> noise_dist(-1.0f, 1.0f);
+    float3 background_color = clear_color.to_float3();
 
-    // Modify the pixel shader to use alpha blending and apply noise
-    rasterizer->pixel_shader = [&](cg::vertex vertex_data, float z) {
-        // Get the current position in 2D
-        int x = static_cast<int>(vertex_data.position.x);
-        int y = static_cast<int>(vertex_data.position.y);
-        
-        // Clamp coordinates to ensure they're within bounds
-        x = std::max(0, std::min(static_cast<int>(settings->width) - 1, x));
-        y = std::max(0, std::min(static_cast<int>(settings->height) - 1, y));
-        
-        // Get source color (object color)
-        cg::color source_color = cg::color::from_float3(vertex_data.ambient);
+    // Without streaming the frame waits for every texture, otherwise it takes the resident ones
+    textures.assign(model->get_index_buffers().size(), nullptr);
+    if (texture_streamer)
+    {
+        auto streaming_start = std::chrono::high_resolution_clock::now();
+        if (settings->texture_streaming)
+            texture_streamer->update();
+        else
+            texture_streamer->wait();
+        textures = texture_streamer->get_textures(model->get_per_shape_texture_files());
+        auto streaming_stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<float, std::milli> streaming_duration = streaming_stop - streaming_start;
+        auto streaming_statistics = texture_streamer->get_statistics();
+        std::cout << "Textures: " << streaming_statistics.resident << " of " << streaming_statistics.files
+                  << " resident, " << streaming_statistics.pending << " pending, " << streaming_statistics.failed
+                  << " failed, " << streaming_statistics.resident_bytes << " of " << streaming_statistics.budget_bytes
+                  << " bytes, " << streaming_statistics.evicted << " evicted, waited " << streaming_duration.count() << "ms\n";
+    }
+
+    // Modify the pixel shader to use alpha blending and apply noise. Every draw gets its own,
+    // holding the texture of its shape in the constants of the draw.
+    auto make_pixel_shader = [this](const draw_constants* constants) {
+        return [this, constants](const shading_varyings& interpolated, const shading_varyings& ddx, const shading_varyings& ddy, float z, int2 pixel) {
+            float3 normal = interpolated.get_float3(VARYING_NORMAL);
         
-        // Apply noise to the color based on position and normal
-        float noise_value = noise_dist(random_generator);
+            // Get source color (object color), modulated by the texture of the shape
+            float3 base_color = interpolated.get_float3(VARYING_AMBIENT);
+            if (const cg::world::texture* texture = constants->texture)
+            {
+                float lod = texture->compute_lod(ddx.get_float2(VARYING_TEXCOORD), ddy.get_float2(VARYING_TEXCOORD));
+                base_color *= texture->sample(interpolated.get_float2(VARYING_TEXCOORD), lod, texture_filter).xyz();
+            }
+            cg::color source_color = cg::color::from_float3(base_color);
         
-        // Create coherent noise based on position and normal
-        float position_factor = std::sin(vertex_data.position.x * noise_frequency) * 
-                                std::cos(vertex_data.position.y * noise_frequency) * 
-                                std::sin(vertex_data.position.z * noise_frequency);
+            // Apply noise to the color based on position and normal. Both kinds are hashed from
+            // the pixel, so every run and every thread gives the same image.
+            float noise_value = cg::utils::white_noise(pixel);
         
-        // Use normal direction to influence noise (creates surface-aware noise)
-        float normal_factor = std::abs(vertex_data.normal.x) + 
-                              std::abs(vertex_data.normal.y) + 
-                              std::abs(vertex_data.normal.z);
+            // Create coherent noise based on the screen position and depth. The pixel shader used to get
+            // the screen position of the first vertex of the triangle, this is its per-pixel counterpart.
+            float position_factor = cg::utils::gradient_noise(float3{
+                static_cast<float>(pixel.x) * noise_frequency,
+                static_cast<float>(pixel.y) * noise_frequency,
+                z * noise_frequency});
         
-        // Combine noise types
-        float combined_noise = noise_value * 0.3f + position_factor * 0.5f + normal_factor * 0.2f;
-        combined_noise *= noise_amplitude;
+            // Use normal direction to influence noise (creates surface-aware noise)
+            float normal_factor = std::abs(normal.x) + 
+                                  std::abs(normal.y) + 
+                                  std::abs(normal.z);
         
-        // Apply noise to color (keeping within valid range)
-        float3 noisy_color = source_color.to_float3();
-        noisy_color.x = std::clamp(noisy_color.x + combined_noise, 0.0f, 1.0f);
-        noisy_color.y = std::clamp(noisy_color.y + combined_noise, 0.0f, 1.0f);
-        noisy_color.z = std::clamp(noisy_color.z + combined_noise, 0.0f, 1.0f);
+            // Combine noise types
+            float combined_noise = noise_value * 0.3f + position_factor * 0.5f + normal_factor * 0.2f;
+            combined_noise *= noise_amplitude;
         
-        // Get destination color (background color)
-        cg::color dest_color = cg::color::from_unsigned_color(original_color_buffer->item(x, y));
+            // Apply noise to color (keeping within valid range)
+            float3 noisy_color = source_color.to_float3();
+            noisy_color.x = std::clamp(noisy_color.x + combined_noise, 0.0f, 1.0f);
+            noisy_color.y = std::clamp(noisy_color.y + combined_noise, 0.0f, 1.0f);
+            noisy_color.z = std::clamp(noisy_color.z + combined_noise, 0.0f, 1.0f);
         
-        // Perform alpha blending: result = alpha * source + (1 - alpha) * destination
-        float3 blended_color = alpha_value * noisy_color + (1.0f - alpha_value) * dest_color.to_float3();
+            // The weighted mode blends in the rasterizer
+            if (weighted_transparency)
+                return cg::color::from_float3(noisy_color);
+
+            // Perform alpha blending against the background: result = alpha * source + (1 - alpha) * destination
+            float3 blended_color = alpha_value * noisy_color + (1.0f - alpha_value) * constants->background_color;
         
-        return cg::color::from_float3(blended_color);
+            return cg::color::from_float3(blended_color);
+        };
     };
 
-    // Draw the model with transparency and noise effect
+    // Every copy of the model has its own frustum in model space, a single copy is the model itself
+    size_t num_instances = instance_transforms.size();
+    cg::utils::arena_vector<cg::world::frustum> instance_frusta{cg::utils::arena_allocator<cg::world::frustum>(frame_arenas.get())};
+    instance_frusta.reserve(num_instances);
+    for (const float4x4& transform : instance_transforms)
+        instance_frusta.push_back(camera->get_frustum(mul(model->get_world_matrix(), transform)));
+    auto is_instance_visible = [&](const cg::world::shape_bounds& bounds, size_t instance_id) {
+        const auto& frustum = instance_frusta[instance_id];
+        return !settings->frustum_culling ||
+               (frustum.is_sphere_visible(bounds.sphere_center, bounds.sphere_radius) &&
+                frustum.is_aabb_visible(bounds.aabb_min, bounds.aabb_max));
+    };
+
+    // Collect the shapes inside the frustum, nearest first to make occlusion culling effective
+    cg::utils::arena_vector<size_t> visible_shapes{cg::utils::arena_allocator<size_t>(frame_arenas.get())};
+    visible_shapes.reserve(model->get_index_buffers().size());
     for (size_t shape_id=0; shape_id<model->get_index_buffers().size(); shape_id++)
     {
-        rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
-        rasterizer->set_index_buffer(model->get_index_buffers()[shape_id]);
-        rasterizer->draw(
-            model->get_index_buffers()[shape_id]->count(), 0);
+        const auto& bounds = model->get_per_shape_bounds()[shape_id];
+        for (size_t instance_id = 0; instance_id < num_instances; instance_id++)
+        {
+            if (is_instance_visible(bounds, instance_id))
+            {
+                visible_shapes.push_back(shape_id);
+                break;
+            }
+        }
+    }
+
+    float3 camera_position = camera->get_position();
+    float3 object_camera_position = mul(inverse(model->get_world_matrix()), float4{camera_position, 1.f}).xyz();
+    // Ties are broken by the shape id, which keeps the order of a stable sort without its temporary buffer
+    std::sort(visible_shapes.begin(), visible_shapes.end(), [&](size_t a, size_t b) {
+        const auto& bounds = model->get_per_shape_bounds();
+        float distance_a = length2(bounds[a].sphere_center - camera_position);
+        float distance_b = length2(bounds[b].sphere_center - camera_position);
+        return distance_a < distance_b || (distance_a == distance_b && a < b);
+    });
+
+    cg::renderer::draw_statistics total_statistics;
+    size_t occluded_shapes = 0;
+    size_t drawn_instances = 0;
+    std::array<size_t, cg::world::MAX_LOD_LEVELS> shapes_per_lod;
+    bool instanced = num_instances > 1;
+    std::array<size_t, cg::world::MAX_LOD_LEVELS> instances_per_lod;
+    auto draw_shapes = [&]() {
+        total_statistics = cg::renderer::draw_statistics{};
+        occluded_shapes = 0;
+        drawn_instances = 0;
+        shapes_per_lod.fill(0);
+        draw_commands.clear();
+        for (size_t shape_id : visible_shapes)
+        {
+            const auto& bounds = model->get_per_shape_bounds()[shape_id];
+            const auto& shape_lods = model->get_per_shape_lods()[shape_id];
+
+            // Copies of the shape far from the camera draw a coarser level from the same buffers,
+            // the copies that share a level are drawn as instances of one draw
+            instances_per_lod.fill(0);
+            for (size_t instance_id = 0; instance_id < num_instances; instance_id++)
+            {
+                const float4x4& transform = instance_transforms[instance_id];
+                if (!is_instance_visible(bounds, instance_id))
+                    continue;
+                if (rasterizer->is_occluded(mul(matrix, transform), bounds.aabb_min, bounds.aabb_max))
+                {
+                    occluded_shapes++;
+                    continue;
+                }
+                const cg::world::shape_lod& lod = settings->lod_error > 0.f ? model->select_lod(shape_id, *camera, settings->lod_error, transform) : shape_lods[0];
+                size_t level = &lod - shape_lods.data();
+                shapes_per_lod[level]++;
+                if (instanced)
+                    instance_buffers[shape_id * cg::world::MAX_LOD_LEVELS + level]->item(instances_per_lod[level]) = transform;
+                instances_per_lod[level]++;
+                drawn_instances++;
+            }
+
+            // Quantized positions are decoded by the matrix itself
+            float4x4 shape_matrix = matrix;
+            float4x4 decode_matrix{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}};
+            if (model->is_compressed())
+            {
+                decode_matrix = cg::utils::dequantization_matrix(bounds.aabb_min, bounds.aabb_max);
+                shape_matrix = mul(matrix, decode_matrix);
+            }
+
+            for (size_t level = 0; level < shape_lods.size(); level++)
+            {
+                size_t instance_count = instances_per_lod[level];
+                if (instance_count == 0)
+                    continue;
+                const cg::world::shape_lod& lod = shape_lods[level];
+
+                // The shaders capture a pointer to the constants of their draw, which fits into
+                // std::function without a heap allocation. The constants live in the frame arena and
+                // the texture in the textures member, the pixel shaders also hold the renderer for the
+                // noise and blending settings, so all of them outlive the visibility buffer resolve.
+                // A single copy of the model keeps its transform out of the vertex shader.
+                cg::renderer::draw_command<cg::vertex_attributes, shading_varyings> command;
+                const cg::material& material = model->get_materials()[model->get_per_shape_material_ids()[shape_id]];
+                auto* constants = frame_arenas.get().allocate_array<draw_constants>(1);
+                constants->shape_matrix = shape_matrix;
+                constants->matrix = matrix;
+                constants->decode_matrix = decode_matrix;
+                // Textured shapes scale their texture by the diffuse color instead of showing the ambient one
+                constants->color = textures[shape_id] ? material.diffuse : material.ambient;
+                constants->background_color = background_color;
+                constants->texture = textures[shape_id].get();
+                constants->instanced = instanced;
+                command.position_shader = [constants](float4 vertex, const cg::renderer::vertex_instance& instance) {
+                    if (constants->instanced)
+                        return mul(constants->matrix, mul(instance.transform, mul(constants->decode_matrix, vertex)));
+                    return mul(constants->shape_matrix, vertex);
+                };
+                command.vertex_shader = [constants](float4 vertex, cg::vertex_attributes vertex_data, const cg::renderer::vertex_instance& instance) {
+                    float4 processed = constants->instanced ? mul(constants->matrix, mul(instance.transform, mul(constants->decode_matrix, vertex))) : mul(constants->shape_matrix, vertex);
+                    shading_varyings out;
+                    out.set_float3(VARYING_NORMAL, vertex_data.normal);
+                    out.set_float2(VARYING_TEXCOORD, vertex_data.texture);
+                    out.set_float3(VARYING_AMBIENT, constants->color);
+                    return std::make_pair(processed, out);
+                };
+                command.pixel_shader = make_pixel_shader(constants);
+
+                if (model->is_compressed())
+                {
+                    command.buffers.quantized_positions = model->get_quantized_position_buffers()[shape_id];
+                    command.buffers.packed_vertices = model->get_packed_attribute_buffers()[shape_id];
+                    if (model->get_short_index_buffers()[shape_id])
+                        command.buffers.short_indices = model->get_short_index_buffers()[shape_id];
+                    else
+                        command.buffers.indices = model->get_index_buffers()[shape_id];
+                }
+                else
+                {
+                    command.buffers.positions = model->get_position_buffers()[shape_id];
+                    command.buffers.vertices = model->get_attribute_buffers()[shape_id];
+                    command.buffers.indices = model->get_index_buffers()[shape_id];
+                }
+                command.index_offset = lod.index_offset;
+                command.index_count = lod.index_count;
+                if (settings->meshlet_culling)
+                {
+                    command.meshlets = model->get_meshlet_buffers()[shape_id]->data() + lod.meshlet_offset;
+                    command.num_meshlets = lod.meshlet_count;
+                    command.matrix = matrix;
+                    command.camera_position = object_camera_position;
+                }
+                if (instanced)
+                {
+                    command.instances = instance_buffers[shape_id * cg::world::MAX_LOD_LEVELS + level];
+                    command.instance_count = instance_count;
+                }
+
+                if (settings->draw_batching)
+                {
+                    draw_commands.push_back(std::move(command));
+                    continue;
+                }
+                rasterizer->set_mesh_buffers(command.buffers);
+                rasterizer->position_shader = command.position_shader;
+                rasterizer->vertex_shader = command.vertex_shader;
+                rasterizer->pixel_shader = command.pixel_shader;
+                if (instanced && command.meshlets)
+                    rasterizer->draw_meshlets_instanced(command.meshlets, command.num_meshlets, command.index_offset, command.matrix, command.camera_position, command.instance_count, command.instances);
+                else if (instanced)
+                    rasterizer->draw_instanced(command.index_count, command.instance_count, command.instances, command.index_offset);
+                else if (command.meshlets)
+                    rasterizer->draw_meshlets(command.meshlets, command.num_meshlets, command.index_offset, command.matrix, command.camera_position);
+                else
+                    rasterizer->draw(command.index_count, command.index_offset);
+                total_statistics += rasterizer->get_draw_statistics();
+            }
+        }
+
+        // All the visible shapes go through the pipeline at once
+        if (settings->draw_batching)
+        {
+            rasterizer->draw_batch(draw_commands);
+            total_statistics += rasterizer->get_draw_statistics();
+        }
+    };
+
+    auto draw_start = std::chrono::high_resolution_clock::now();
+
+    // Optional depth-only pre-pass, so the color pass shades only the visible surfaces
+    if (settings->depth_prepass && !weighted_transparency)
+    {
+        rasterizer->set_color_write(false);
+        draw_shapes();
+        rasterizer->set_color_write(true);
+        rasterizer->set_depth_function(cg::renderer::depth_function::less_equal);
+    }
+
+    // Draw the model with transparency and noise effect, in one unsorted pass with weighted transparency
+    if (weighted_transparency)
+        rasterizer->set_blend_mode(cg::renderer::blend_mode::weighted, alpha_value);
+    draw_shapes();
+    rasterizer->set_blend_mode(cg::renderer::blend_mode::opaque);
+    rasterizer->set_depth_function(cg::renderer::depth_function::less);
+    auto draw_stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<float, std::milli> draw_duration = draw_stop - draw_start;
+    std::cout << "Drawing took " << draw_duration.count() << "ms\n";
+
+    // The transparent surfaces blend over the resolved opaque pixels
+    if (sample_colors)
+    {
+        auto multisample_start = std::chrono::high_resolution_clock::now();
+        rasterizer->resolve_multisampling();
+        auto multisample_stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<float, std::milli> multisample_duration = multisample_stop - multisample_start;
+        std::cout << "Multisample resolve took " << multisample_duration.count() << "ms\n";
+    }
+
+    if (weighted_transparency)
+    {
+        auto transparency_start = std::chrono::high_resolution_clock::now();
+        rasterizer->resolve_transparency();
+        auto transparency_stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<float, std::milli> transparency_duration = transparency_stop - transparency_start;
+        std::cout << "Transparency resolve took " << transparency_duration.count() << "ms\n";
+    }
+
+    // In the visibility buffer mode the draws only stored triangle ids, shade them now
+    if (visibility_buffer)
+    {
+        auto resolve_start = std::chrono::high_resolution_clock::now();
+        rasterizer->resolve_visibility_buffer();
+        auto resolve_stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<float, std::milli> resolve_duration = resolve_stop - resolve_start;
+        std::cout << "Visibility buffer resolve took " << resolve_duration.count() << "ms\n";
     }
 
+    std::cout << "Frustum culling skipped " << model->get_index_buffers().size() - visible_shapes.size() << " of "
+              << model->get_index_buffers().size() << " shapes\n";
+    std::cout << "Occlusion culling skipped " << occluded_shapes << " of "
+              << visible_shapes.size() << " shapes\n";
+    if (num_instances > 1)
+    {
+        std::cout << "Instances: drawn " << drawn_instances << " of "
+                  << visible_shapes.size() * num_instances << " copies of the visible shapes\n";
+    }
+    if (settings->lod_levels > 1)
+    {
+        std::cout << "Shapes drawn per level of detail:";
+        for (size_t count : shapes_per_lod)
+            std::cout << " " << count;
+        std::cout << "\n";
+    }
+    std::cout << "Triangles: " << total_statistics.triangles
+              << ", rasterized: " << total_statistics.rasterized
+              << ", culled: " << total_statistics.culled()
+              << " (facing " << total_statistics.culled_facing
+              << ", zero area " << total_statistics.culled_zero_area
+              << ", small " << total_statistics.culled_small
+              << ", outside " << total_statistics.culled_outside
+              << ", occluded " << total_statistics.culled_occluded
+              << "), clipped: " << total_statistics.clipped << "\n";
+    std::cout << "Vertices shaded: " << total_statistics.shaded_vertices << " for "
+              << total_statistics.triangles << " triangles\n";
+    if (settings->meshlet_culling)
+    {
+        std::cout << "Meshlets: " << total_statistics.meshlets
+                  << ", culled outside: " << total_statistics.culled_meshlets_outside
+                  << ", facing: " << total_statistics.culled_meshlets_facing << "\n";
+    }
+
+    // Fill the tiles no draw has touched with the clear color
+    auto clear_resolve_start = std::chrono::high_resolution_clock::now();
+    rasterizer->resolve_fast_clear();
+    auto clear_resolve_stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<float, std::milli> clear_resolve_duration = clear_resolve_stop - clear_resolve_start;
+    std::cout << "Fast clear resolve took " << clear_resolve_duration.count() << "ms\n";
+
     cg::utils::save_resource(*render_target, settings->result_path);
+
+    auto arena_statistics = frame_arenas.get_statistics();
+    std::cout << "Frame arenas: " << arena_statistics.allocations << " allocations, "
+              << arena_statistics.used_bytes << " of " << arena_statistics.capacity << " bytes, "
+              << arena_statistics.block_allocations << " new blocks\n";
+    frame_arenas.reset();
 }
 
 void cg::renderer::rasterization_renderer::destroy() {}
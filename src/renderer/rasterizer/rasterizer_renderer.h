@@ -3,10 +3,19 @@
 #include "renderer/rasterizer/rasterizer.h"
 #include "renderer/renderer.h"
 #include "resource.h"
-#include <random>
+#include "utils/arena.h"
+#include "world/texture.h"
+#include "world/texture_streamer.h"
+#include <vector>
 
 namespace cg::renderer
 {
+    // Attributes interpolated from the vertex to the pixel shader: normal, texture coordinates, ambient color
+    using shading_varyings = varyings<8>;
+    static constexpr size_t VARYING_NORMAL = 0;
+    static constexpr size_t VARYING_TEXCOORD = 3;
+    static constexpr size_t VARYING_AMBIENT = 5;
+
     class rasterization_renderer : public renderer
     {
     public:
@@ -17,20 +26,53 @@ namespace cg::renderer
         virtual void render();
 
     protected:
-        std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
+        std::shared_ptr<cg::resource<cg::unsigned_color4>> render_target;
         std::shared_ptr<cg::resource<float>> depth_buffer;
-        
-        // Buffer for storing original colors (for transparency blending)
-        std::shared_ptr<cg::resource<cg::unsigned_color>> original_color_buffer;
+        std::shared_ptr<cg::resource<cg::renderer::visibility_sample>> visibility_buffer;
+        std::shared_ptr<cg::resource<float4>> accumulation_buffer;
+        std::shared_ptr<cg::resource<float>> revealage_buffer;
+        // Samples of every pixel side by side, only with multisampling
+        std::shared_ptr<cg::resource<cg::unsigned_color4>> sample_colors;
+        std::shared_ptr<cg::resource<float>> sample_depths;
+
+        // Background color, transparent surfaces are blended against it
+        cg::unsigned_color4 clear_color{111, 15, 112, 255};
         
         // Alpha value for transparency
         float alpha_value = 0.5f;
+        // Transparent surfaces are blended order-independently instead of against the background
+        bool weighted_transparency = false;
         
         // Noise effect parameters
         float noise_amplitude = 0.1f;    // Strength of the noise effect
         float noise_frequency = 0.05f;   // Spatial frequency of the noise
-        std::mt19937 random_generator;   // Random number generator
 
-        std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+        // Diffuse texture of every shape for the current frame, null for the untextured ones
+        std::vector<std::shared_ptr<cg::world::texture>> textures;
+        std::shared_ptr<cg::world::texture_streamer> texture_streamer;
+        cg::world::texture_filter texture_filter = cg::world::texture_filter::trilinear;
+
+        // Model space transforms of the copies of the model, drawn as instances
+        std::vector<float4x4> instance_transforms;
+        // Transforms of the copies drawn with every level of every shape, by shape * MAX_LOD_LEVELS + level
+        std::vector<std::shared_ptr<cg::resource<float4x4>>> instance_buffers;
+
+        // Transient data of the current frame, reset at the end of render()
+        cg::utils::frame_arenas frame_arenas;
+        // Constants of one draw, in the frame arena
+        struct draw_constants
+        {
+            float4x4 shape_matrix;
+            float4x4 matrix;
+            float4x4 decode_matrix;
+            float3 color;
+            float3 background_color;
+            const cg::world::texture* texture;
+            bool instanced;
+        };
+        // Commands of the batched draws, kept between the frames to reuse the allocation
+        std::vector<cg::renderer::draw_command<cg::vertex_attributes, shading_varyings>> draw_commands;
+
+        std::shared_ptr<cg::renderer::rasterizer<cg::vertex_attributes, cg::unsigned_color4, shading_varyings>> rasterizer;
     };
 }// namespace cg::renderer
\ No newline at end of file
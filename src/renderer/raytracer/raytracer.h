@@ -1,6 +1,7 @@
 #pragma once
 
 #include "resource.h"
+#include "world/texture.h"
 
 #include <iostream>
 #include <linalg.h>
@@ -32,7 +33,10 @@ namespace cg::renderer
 	template<typename VB>
 	struct triangle
 	{
-		triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
+		triangle(
+				const float3& position_a, const float3& position_b, const float3& position_c,
+				const VB& vertex_a, const VB& vertex_b, const VB& vertex_c,
+				const cg::material& in_material);
 
 		float3 a;
 		float3 b;
@@ -45,18 +49,25 @@ namespace cg::renderer
 		float3 nb;
 		float3 nc;
 
-		float3 ambient;
-		float3 diffuse;
-		float3 emissive;
+		float2 ta;
+		float2 tb;
+		float2 tc;
+
+		// Points into the material table of the raytracer
+		const cg::material* material;
+		// Diffuse texture of the shape, null when it has none
+		const cg::world::texture* texture = nullptr;
 	};
 
 	template<typename VB>
 	inline triangle<VB>::triangle(
-			const VB& vertex_a, const VB& vertex_b, const VB& vertex_c)
+			const float3& position_a, const float3& position_b, const float3& position_c,
+			const VB& vertex_a, const VB& vertex_b, const VB& vertex_c,
+			const cg::material& in_material)
 	{
-		a = vertex_a.position;
-		b = vertex_b.position;
-		c = vertex_c.position;
+		a = position_a;
+		b = position_b;
+		c = position_c;
 
 		ba = b - a;
 		ca = c - a;
@@ -65,15 +76,18 @@ namespace cg::renderer
 		nb = vertex_b.normal;
 		nc = vertex_c.normal;
 
-		ambient = vertex_a.ambient;
-		diffuse = vertex_a.diffuse;
-		emissive = vertex_a.emissive;
+		ta = vertex_a.texture;
+		tb = vertex_b.texture;
+		tc = vertex_c.texture;
+
+		material = &in_material;
 	}
 
 	template<typename VB>
 	class aabb
 	{
 	public:
+		void reserve(size_t num_triangles);
 		void add_triangle(const triangle<VB> triangle);
 		const std::vector<triangle<VB>>& get_triangles() const;
 		bool aabb_test(const ray& ray) const;
@@ -91,6 +105,13 @@ namespace cg::renderer
 		float3 color;
 	};
 
+	// Part of the index buffer of a shape that gets traced, e.g. one level of detail
+	struct index_range
+	{
+		size_t offset;
+		size_t count;
+	};
+
 	template<typename VB, typename RT>
 	class raytracer
 	{
@@ -102,8 +123,14 @@ namespace cg::renderer
 		void clear_render_target(const RT& in_clear_value);
 		void set_viewport(size_t in_width, size_t in_height);
 
+		void set_position_buffers(std::vector<std::shared_ptr<cg::resource<float3>>> in_position_buffers);
 		void set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers);
 		void set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers);
+		void set_materials(std::vector<cg::material> in_materials, std::vector<unsigned int> in_material_ids);
+		// Per shape, the whole index buffers are traced when there are no ranges
+		void set_index_ranges(std::vector<index_range> in_index_ranges);
+		// Per shape, null for the untextured ones
+		void set_textures(std::vector<std::shared_ptr<cg::world::texture>> in_textures);
 		void build_acceleration_structure();
 		std::vector<aabb<VB>> acceleration_structures;
 
@@ -124,7 +151,12 @@ namespace cg::renderer
 		std::shared_ptr<cg::resource<RT>> render_target;
 		std::shared_ptr<cg::resource<float3>> history;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
+		std::vector<std::shared_ptr<cg::resource<float3>>> position_buffers;
 		std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
+		std::vector<cg::material> materials;
+		std::vector<unsigned int> material_ids;
+		std::vector<index_range> index_ranges;
+		std::vector<std::shared_ptr<cg::world::texture>> textures;
 		std::vector<triangle<VB>> triangles;
 
 		size_t width = 1920;
@@ -145,18 +177,23 @@ namespace cg::renderer
 		height = in_height;
 		width = in_width;
 
-		history = std::make_shared<cg::resource<float3>>(width, height);
+		resource_allocation history_allocation;
+		history_allocation.huge_pages = true;
+		history = std::make_shared<cg::resource<float3>>(width, height, history_allocation);
 	}
 
 	template<typename VB, typename RT>
 	inline void raytracer<VB, RT>::clear_render_target(
 			const RT& in_clear_value)
 	{
-		for (size_t i = 0; i < render_target->count(); i++)
-		{
-			render_target->item(i) = in_clear_value;
-			history->item(i) = float3{0.f, 0.f, 0.f};
-		}
+		render_target->fill(in_clear_value);
+		history->fill(float3{0.f, 0.f, 0.f});
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_position_buffers(std::vector<std::shared_ptr<cg::resource<float3>>> in_position_buffers)
+	{
+		position_buffers = in_position_buffers;
 	}
 
 	template<typename VB, typename RT>
@@ -171,23 +208,55 @@ namespace cg::renderer
 		index_buffers = in_index_buffers;
 	}
 
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_materials(std::vector<cg::material> in_materials, std::vector<unsigned int> in_material_ids)
+	{
+		materials = in_materials;
+		material_ids = in_material_ids;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_index_ranges(std::vector<index_range> in_index_ranges)
+	{
+		index_ranges = in_index_ranges;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_textures(std::vector<std::shared_ptr<cg::world::texture>> in_textures)
+	{
+		textures = in_textures;
+	}
+
 	template<typename VB, typename RT>
 	inline void raytracer<VB, RT>::build_acceleration_structure()
 	{
+		acceleration_structures.clear();
 		for (size_t shape_id = 0; shape_id < vertex_buffers.size(); shape_id++)
 		{
 			auto& index_buffer = index_buffers[shape_id];
 			auto& vertex_buffer = vertex_buffers[shape_id];
 
-			size_t index_id = 0;
+			const unsigned int* indices = index_buffer->data();
+			const float3* positions = position_buffers[shape_id]->data();
+			const VB* vertices = vertex_buffer->data();
+			const cg::material& material = materials[material_ids[shape_id]];
+			const cg::world::texture* texture = textures.empty() ? nullptr : textures[shape_id].get();
+			index_range range = index_ranges.empty() ? index_range{0, index_buffer->count()} : index_ranges[shape_id];
+			size_t index_id = range.offset;
 			aabb<VB> aabb;
-			while(index_id < index_buffer->count())
+			aabb.reserve(range.count / 3);
+			while(index_id < range.offset + range.count)
 			{
+				unsigned int index_a = indices[index_id];
+				unsigned int index_b = indices[index_id + 1];
+				unsigned int index_c = indices[index_id + 2];
 				triangle<VB> triangle(
-						vertex_buffer->item(index_buffer->item(index_id++)),
-						vertex_buffer->item(index_buffer->item(index_id++)),
-						vertex_buffer->item(index_buffer->item(index_id++))
+						positions[index_a], positions[index_b], positions[index_c],
+						vertices[index_a], vertices[index_b], vertices[index_c],
+						material
 				);
+				triangle.texture = texture;
+				index_id += 3;
 				aabb.add_triangle(triangle);
 				
 			}
@@ -206,9 +275,11 @@ namespace cg::renderer
 			std::cout << "Tracing frame #" << frame_id + 1 << "\n";
 			float2 jitter = get_jitter(frame_id);
 			#pragma omp parallel for
-			for (int x = 0; x < width; x++)
+			for (int y = 0; y < static_cast<int>(height); y++)
 			{
-				for (int y = 0; y < height; y++)
+				float3* history_row = history->row(y);
+				RT* render_target_row = render_target->row(y);
+				for (int x = 0; x < static_cast<int>(width); x++)
 				{
 					float u = (2.f * x + jitter.x)/static_cast<float>(width - 1) - 1.f;
 					// float v = 1.f - (2.f * y)/static_cast<float>(height - 1) - 1.f;
@@ -220,11 +291,11 @@ namespace cg::renderer
 
 					payload payload = trace_ray(ray, depth);
 
-					auto& history_pixel = history->item(x, y);
+					auto& history_pixel = history_row[x];
 					history_pixel += payload.color.to_float3() * frame_weight;
 
 					if (frame_id == accumulation_num - 1)
-						render_target->item(x, y) = RT::from_float3(history_pixel);
+						render_target_row[x] = RT::from_float3(history_pixel);
 
 				}
 			}
@@ -342,6 +413,12 @@ namespace cg::renderer
 	}
 
 
+	template<typename VB>
+	inline void aabb<VB>::reserve(size_t num_triangles)
+	{
+		triangles.reserve(num_triangles);
+	}
+
 	template<typename VB>
 	inline void aabb<VB>::add_triangle(const triangle<VB> triangle)
 	{
@@ -1,5 +1,7 @@
 #include "raytracer_renderer.h"
 
+#include "utils/error_handler.h"
+#include "utils/noise.h"
 #include "utils/resource_utils.h"
 
 #include <iostream>
@@ -9,7 +11,7 @@ void cg::renderer::ray_tracing_renderer::init()
 {
 	
 	model = std::make_shared<cg::world::model>();
-	model->load_obj(settings->model_path);
+	model->load_obj(settings->model_path, settings->mesh_cache, settings->mesh_optimization, settings->lod_levels);
 
 	camera = std::make_shared<cg::world::camera>();
     camera->set_height(static_cast<float>(settings->height));
@@ -27,22 +29,34 @@ void cg::renderer::ray_tracing_renderer::init()
     camera->set_z_far(settings->camera_z_far);
 
 
-	raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+	raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex_attributes, cg::unsigned_color>>();
 	render_target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
 
 	raytracer->set_render_target(render_target);
 	raytracer->set_viewport(settings->width, settings->height);
 	raytracer->set_index_buffers(model->get_index_buffers());
-	raytracer->set_vertex_buffers(model->get_vertex_buffers());
+	raytracer->set_position_buffers(model->get_position_buffers());
+	raytracer->set_vertex_buffers(model->get_attribute_buffers());
+	raytracer->set_materials(model->get_materials(), model->get_per_shape_material_ids());
+
+	texture_filter = cg::world::parse_texture_filter(settings->texture_filter);
+	// Textures decode in the background while the rest of the frame is set up
+	if (settings->textures)
+	{
+		texture_streamer = std::make_shared<cg::world::texture_streamer>(size_t{settings->texture_budget} << 20);
+		texture_streamer->prefetch(model->get_per_shape_texture_files());
+	}
 
 	
 	lights.push_back(light{
 		float3{0.f, 1.58f, -0.03f},
 		float3{0.78f, 0.78f, 0.78f},
 	});
-	shadow_raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+	shadow_raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex_attributes, cg::unsigned_color>>();
 	shadow_raytracer->set_index_buffers(model->get_index_buffers());
-	shadow_raytracer->set_vertex_buffers(model->get_vertex_buffers());
+	shadow_raytracer->set_position_buffers(model->get_position_buffers());
+	shadow_raytracer->set_vertex_buffers(model->get_attribute_buffers());
+	shadow_raytracer->set_materials(model->get_materials(), model->get_per_shape_material_ids());
 }
 
 void cg::renderer::ray_tracing_renderer::destroy() {}
@@ -62,11 +76,11 @@ void cg::renderer::ray_tracing_renderer::render()
 		return payload;
 	};
 	
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_real_distribution<float> dis(-1.f, 1.f);
+	// Angle between the rays of neighbouring pixels, the image plane of ray_generation()
+	// spans two units over the height at a unit distance
+	float pixel_spread = 2.f / static_cast<float>(settings->height);
 
-	raytracer->closest_hit_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth) {
+	raytracer->closest_hit_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex_attributes>& triangle, size_t depth) {
 		float3 position = ray.position + ray.direction * payload.t;
 		float3 normal = normalize(
 			payload.bary.x * triangle.na +
@@ -74,12 +88,35 @@ void cg::renderer::ray_tracing_renderer::render()
 			payload.bary.z * triangle.nc
 		);
 
-		float3 result_color = triangle.emissive;
-
+		float3 result_color = triangle.material->emissive;
+
+		// The level of detail follows the ray cone: its width at the hit, projected on the
+		// triangle and scaled to texture coordinates by the texture to world area ratio.
+		// Secondary rays use the spread of a pixel too, which only oversharpens them.
+		float3 diffuse = triangle.material->diffuse;
+		if (triangle.texture)
+		{
+			float2 uv = payload.bary.x * triangle.ta + payload.bary.y * triangle.tb + payload.bary.z * triangle.tc;
+			float3 face_normal = cross(triangle.ba, triangle.ca);
+			float world_area = std::max(length(face_normal), 1e-12f);
+			float2 uv_b = triangle.tb - triangle.ta;
+			float2 uv_c = triangle.tc - triangle.ta;
+			float uv_area = std::abs(uv_b.x * uv_c.y - uv_b.y * uv_c.x);
+			float cosine = std::max(std::abs(dot(ray.direction, face_normal)) / world_area, 0.01f);
+			float footprint = payload.t * pixel_spread / cosine * std::sqrt(uv_area / world_area);
+			diffuse *= triangle.texture->sample(uv, triangle.texture->compute_lod(footprint), texture_filter).xyz();
+		}
+
+		// The bounce is hashed from the hit, the rays of the pixels and frames differ by
+		// their jitter. A generator shared by the threads would race.
+		uint32_t seed = cg::utils::hash(
+				cg::utils::float_bits(position.x),
+				cg::utils::float_bits(position.y),
+				cg::utils::float_bits(position.z) ^ static_cast<uint32_t>(depth));
 		float3 random_direction{
-			dis(gen),
-			dis(gen),
-			dis(gen)
+			cg::utils::hash_to_signed_float(cg::utils::hash(seed, 0)),
+			cg::utils::hash_to_signed_float(cg::utils::hash(seed, 1)),
+			cg::utils::hash_to_signed_float(cg::utils::hash(seed, 2))
 		};
 
 		if (dot(normal, random_direction) < 0.f)
@@ -89,13 +126,50 @@ void cg::renderer::ray_tracing_renderer::render()
 		cg::renderer::ray to_next_object(position, random_direction);
 		auto next_payload = raytracer->trace_ray(to_next_object, depth);
 		
-		result_color += triangle.diffuse * next_payload.color.to_float3() * std::max(0.f, dot(normal, to_next_object.direction));
+		result_color += diffuse * next_payload.color.to_float3() * std::max(0.f, dot(normal, to_next_object.direction));
 	
 		
 		payload.color = cg::color::from_float3(result_color);
 		return payload;
 	};
 	
+	// Levels of detail are picked once per frame from the camera, secondary rays see the same geometry
+	std::vector<cg::renderer::index_range> index_ranges;
+	std::vector<size_t> shapes_per_lod(cg::world::MAX_LOD_LEVELS);
+	for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); shape_id++)
+	{
+		const auto& shape_lods = model->get_per_shape_lods()[shape_id];
+		const cg::world::shape_lod& lod = settings->lod_error > 0.f ? model->select_lod(shape_id, *camera, settings->lod_error) : shape_lods[0];
+		shapes_per_lod[&lod - shape_lods.data()]++;
+		index_ranges.push_back(cg::renderer::index_range{lod.index_offset, lod.index_count});
+	}
+	raytracer->set_index_ranges(index_ranges);
+	if (settings->lod_levels > 1)
+	{
+		std::cout << "Shapes traced per level of detail:";
+		for (size_t count : shapes_per_lod)
+			std::cout << " " << count;
+		std::cout << "\n";
+	}
+
+	// Without streaming the frame waits for every texture, otherwise it takes the resident ones
+	if (texture_streamer)
+	{
+		auto streaming_start = std::chrono::high_resolution_clock::now();
+		if (settings->texture_streaming)
+			texture_streamer->update();
+		else
+			texture_streamer->wait();
+		raytracer->set_textures(texture_streamer->get_textures(model->get_per_shape_texture_files()));
+		auto streaming_stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> streaming_duration = streaming_stop - streaming_start;
+		auto streaming_statistics = texture_streamer->get_statistics();
+		std::cout << "Textures: " << streaming_statistics.resident << " of " << streaming_statistics.files
+				  << " resident, " << streaming_statistics.pending << " pending, " << streaming_statistics.failed
+				  << " failed, " << streaming_statistics.resident_bytes << " of " << streaming_statistics.budget_bytes
+				  << " bytes, " << streaming_statistics.evicted << " evicted, waited " << streaming_duration.count() << "ms\n";
+	}
+
 	raytracer->build_acceleration_structure();
 
 	auto start = std::chrono::high_resolution_clock::now();
@@ -1,6 +1,7 @@
 #include "renderer/raytracer/raytracer.h"
 #include "renderer/renderer.h"
 #include "resource.h"
+#include "world/texture_streamer.h"
 
 
 namespace cg::renderer
@@ -17,9 +18,12 @@ namespace cg::renderer
 	protected:
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> raytracer;
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
+		std::shared_ptr<cg::renderer::raytracer<cg::vertex_attributes, cg::unsigned_color>> raytracer;
+		std::shared_ptr<cg::renderer::raytracer<cg::vertex_attributes, cg::unsigned_color>> shadow_raytracer;
 
 		std::vector<cg::renderer::light> lights;
+
+		cg::world::texture_filter texture_filter = cg::world::texture_filter::trilinear;
+		std::shared_ptr<cg::world::texture_streamer> texture_streamer;
 	};
 }// namespace cg::renderer
\ No newline at end of file
@@ -3,66 +3,417 @@
 #include "utils/error_handler.h"
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <linalg.h>
-#include <vector>
+#include <memory>
+#include <numeric>
+#include <type_traits>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 
 using namespace linalg::aliases;
 
 namespace cg
 {
+	// Non-owning, unchecked views of the items of a resource
+	template<typename T>
+	struct resource_view
+	{
+		T* items;
+		size_t size;
+
+		T& operator[](size_t i) const
+		{
+			return items[i];
+		}
+		T* begin() const
+		{
+			return items;
+		}
+		T* end() const
+		{
+			return items + size;
+		}
+	};
+
+	template<typename T>
+	struct resource_view_2d
+	{
+		T* items;
+		size_t width;
+		size_t height;
+		size_t stride;
+
+		T* row(size_t y) const
+		{
+			return items + y * stride;
+		}
+		T& operator()(size_t x, size_t y) const
+		{
+			return items[y * stride + x];
+		}
+	};
+
+	constexpr size_t CACHE_LINE_SIZE = 64;
+	constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+	// Side of the square tiles of the tiled 2D layouts
+	constexpr size_t RESOURCE_TILE_SIZE = 8;
+
+	// Order of the items of a 2D resource in memory
+	enum class resource_layout
+	{
+		// Row after row
+		linear,
+		// Tiles row after row, each tile row-major and contiguous
+		tiled,
+		// Tiles row after row, each tile in Z-order
+		morton
+	};
+
+	// Offset of an item inside a tile of the morton layout
+	inline size_t morton_tile_offset(size_t local_x, size_t local_y)
+	{
+		static_assert(RESOURCE_TILE_SIZE == 8, "The interleave covers 3 bits of each coordinate");
+		// Interleaves the 3 bits of the coordinates: y2 x2 y1 x1 y0 x0
+		auto spread = [](size_t v) { return (v & 1) | ((v & 2) << 1) | ((v & 4) << 2); };
+		return spread(local_x) | (spread(local_y) << 1);
+	}
+
+	// Offset of an item in the morton layout of a resource tiles_x tiles wide
+	inline size_t morton_offset(size_t x, size_t y, size_t tiles_x)
+	{
+		size_t tile_x = x / RESOURCE_TILE_SIZE;
+		size_t tile_y = y / RESOURCE_TILE_SIZE;
+		return (tile_y * tiles_x + tile_x) * RESOURCE_TILE_SIZE * RESOURCE_TILE_SIZE +
+			   morton_tile_offset(x % RESOURCE_TILE_SIZE, y % RESOURCE_TILE_SIZE);
+	}
+
+	// How the storage of a resource is allocated
+	struct resource_allocation
+	{
+		// Alignment of the storage in bytes, a power of two
+		size_t alignment = CACHE_LINE_SIZE;
+		// Rounds the row pitch of 2D resources up to a multiple of the alignment
+		bool pad_rows = true;
+		// Asks for transparent huge pages when the storage spans at least one huge page
+		bool huge_pages = false;
+		// Layout of 2D resources, 1D resources are always linear
+		resource_layout layout = resource_layout::linear;
+	};
+
+	namespace detail
+	{
+		inline void* allocate_aligned(size_t bytes, const resource_allocation& allocation)
+		{
+			size_t alignment = std::max(allocation.alignment, alignof(std::max_align_t));
+			bool huge = allocation.huge_pages && bytes >= HUGE_PAGE_SIZE;
+			if (huge)
+				alignment = std::max(alignment, HUGE_PAGE_SIZE);
+			// aligned_alloc wants the size to be a multiple of the alignment
+			bytes = (std::max(bytes, size_t{1}) + alignment - 1) / alignment * alignment;
+#ifdef _WIN32
+			void* pointer = _aligned_malloc(bytes, alignment);
+#else
+			void* pointer = std::aligned_alloc(alignment, bytes);
+#endif
+			if (!pointer)
+				THROW_ERROR("Can't allocate the resource storage");
+#ifdef __linux__
+			if (huge)
+				madvise(pointer, bytes, MADV_HUGEPAGE);
+#endif
+			return pointer;
+		}
+
+		inline void free_aligned(void* pointer)
+		{
+#ifdef _WIN32
+			_aligned_free(pointer);
+#else
+			std::free(pointer);
+#endif
+		}
+	}// namespace detail
+
+	// item() checks the bounds only when CG_RESOURCE_CHECKS is defined (Debug builds),
+	// hot loops should prefer data(), row() or the views. row() and view_2d() are
+	// for the linear layout only, tile() and tile_offset() work with every layout.
 	template<typename T>
 	class resource
 	{
 	public:
-		resource(size_t size);
-		resource(size_t x_size, size_t y_size);
+		resource(size_t size, const resource_allocation& allocation = {});
+		resource(size_t x_size, size_t y_size, const resource_allocation& allocation = {});
+		// Wraps items that live elsewhere, e.g. in a mapped file, without copying them.
+		// The owner is kept alive as long as the resource.
+		resource(T* external_items, size_t size, std::shared_ptr<void> owner);
 		~resource();
 
+		resource(const resource&) = delete;
+		resource& operator=(const resource&) = delete;
+
 		const T* get_data();
+		T* data();
+		const T* data() const;
+		T* row(size_t y);
+		T* tile(size_t tile_x, size_t tile_y);
+		size_t tile_offset(size_t local_x, size_t local_y) const;
+		size_t offset(size_t x, size_t y) const;
 		T& item(size_t item);
 		T& item(size_t x, size_t y);
+		void fill(const T& value);
+		void fill_tile(size_t tile_x, size_t tile_y, const T& value);
+
+		// Copies the items row after row to a linear destination, the pitch is in items
+		void linearize(T* destination, size_t destination_pitch) const;
 
+		resource_view<T> view();
+		resource_view_2d<T> view_2d();
+
+		// For 2D resources the sizes include the row padding
 		size_t size_bytes() const;
 		size_t count() const;
 		size_t get_stride() const;
+		size_t get_pitch() const;
+		size_t get_width() const;
+		size_t get_height() const;
+		resource_layout get_layout() const;
 
 	private:
-		std::vector<T> data;
+		void allocate(const resource_allocation& allocation);
+
+		T* storage = nullptr;
+		// Number of the allocated items, including the row padding
+		size_t storage_count = 0;
+		// Set when the items are not owned by the resource
+		std::shared_ptr<void> external_owner;
 		size_t item_size = sizeof(T);
 		size_t stride;
+		size_t width;
+		size_t height;
+		resource_layout layout = resource_layout::linear;
+		size_t tiles_x = 0;
 	};
 
 	template<typename T>
-	inline resource<T>::resource(size_t size)
+	inline resource<T>::resource(size_t size, const resource_allocation& allocation)
 	{
-		data.resize(size);
 		stride = 0;
+		width = size;
+		height = 1;
+		storage_count = size;
+		allocate(allocation);
+	}
+	template<typename T>
+	inline resource<T>::resource(size_t x_size, size_t y_size, const resource_allocation& allocation)
+	{
+		width = x_size;
+		height = y_size;
+		layout = allocation.layout;
+		if (layout == resource_layout::linear)
+		{
+			stride = x_size;
+			if (allocation.pad_rows)
+			{
+				// The smallest number of items whose size is a multiple of the alignment
+				size_t alignment_items = allocation.alignment / std::gcd(sizeof(T), allocation.alignment);
+				stride = (x_size + alignment_items - 1) / alignment_items * alignment_items;
+			}
+			storage_count = stride * y_size;
+		}
+		else
+		{
+			// Both sides are padded to whole tiles
+			tiles_x = (x_size + RESOURCE_TILE_SIZE - 1) / RESOURCE_TILE_SIZE;
+			size_t tiles_y = (y_size + RESOURCE_TILE_SIZE - 1) / RESOURCE_TILE_SIZE;
+			stride = tiles_x * RESOURCE_TILE_SIZE;
+			storage_count = stride * tiles_y * RESOURCE_TILE_SIZE;
+		}
+		allocate(allocation);
 	}
 	template<typename T>
-	inline resource<T>::resource(size_t x_size, size_t y_size)
+	inline resource<T>::resource(T* external_items, size_t size, std::shared_ptr<void> owner)
 	{
-		data.resize(x_size * y_size);
-		stride = x_size;
+		static_assert(std::is_trivially_copyable_v<T>, "Only plain data can be wrapped");
+		storage = external_items;
+		storage_count = size;
+		external_owner = std::move(owner);
+		stride = 0;
+		width = size;
+		height = 1;
 	}
 	template<typename T>
 	inline resource<T>::~resource()
 	{
+		if (external_owner)
+			return;
+		std::destroy_n(storage, storage_count);
+		detail::free_aligned(storage);
+	}
+	template<typename T>
+	inline void resource<T>::allocate(const resource_allocation& allocation)
+	{
+		storage = static_cast<T*>(detail::allocate_aligned(storage_count * sizeof(T), allocation));
+		std::uninitialized_value_construct_n(storage, storage_count);
 	}
 	template<typename T>
 	inline const T* resource<T>::get_data()
 	{
-		return data.data();
+		return storage;
+	}
+	template<typename T>
+	inline T* resource<T>::data()
+	{
+		return storage;
+	}
+	template<typename T>
+	inline const T* resource<T>::data() const
+	{
+		return storage;
+	}
+	template<typename T>
+	inline T* resource<T>::row(size_t y)
+	{
+#ifdef CG_RESOURCE_CHECKS
+		if (y >= height)
+			THROW_ERROR("Resource row is out of range");
+		if (layout != resource_layout::linear)
+			THROW_ERROR("Rows are only contiguous in the linear layout");
+#endif
+		return storage + y * stride;
+	}
+	template<typename T>
+	inline T* resource<T>::tile(size_t tile_x, size_t tile_y)
+	{
+		if (layout == resource_layout::linear)
+			return storage + tile_y * RESOURCE_TILE_SIZE * stride + tile_x * RESOURCE_TILE_SIZE;
+		return storage + (tile_y * tiles_x + tile_x) * RESOURCE_TILE_SIZE * RESOURCE_TILE_SIZE;
+	}
+	template<typename T>
+	inline size_t resource<T>::tile_offset(size_t local_x, size_t local_y) const
+	{
+		switch (layout)
+		{
+			case resource_layout::tiled:
+				return local_y * RESOURCE_TILE_SIZE + local_x;
+			case resource_layout::morton:
+				return morton_tile_offset(local_x, local_y);
+			default:
+				return local_y * stride + local_x;
+		}
+	}
+	template<typename T>
+	inline size_t resource<T>::offset(size_t x, size_t y) const
+	{
+		if (layout == resource_layout::linear)
+			return y * stride + x;
+		size_t tile_x = x / RESOURCE_TILE_SIZE;
+		size_t tile_y = y / RESOURCE_TILE_SIZE;
+		return (tile_y * tiles_x + tile_x) * RESOURCE_TILE_SIZE * RESOURCE_TILE_SIZE +
+			   tile_offset(x % RESOURCE_TILE_SIZE, y % RESOURCE_TILE_SIZE);
 	}
 	template<typename T>
 	inline T& resource<T>::item(size_t item)
 	{
-		return data.at(item);
+#ifdef CG_RESOURCE_CHECKS
+		if (item >= storage_count)
+			THROW_ERROR("Resource item is out of range");
+#endif
+		return storage[item];
 	}
 	template<typename T>
 	inline T& resource<T>::item(size_t x, size_t y)
 	{
-		return data.at(y * stride + x);
+#ifdef CG_RESOURCE_CHECKS
+		if (x >= width || y >= height)
+			THROW_ERROR("Resource coordinates are out of range");
+#endif
+		return storage[offset(x, y)];
+	}
+	template<typename T>
+	inline void resource<T>::fill(const T& value)
+	{
+		// Large contiguous chunks let every thread run a vectorized fill
+		constexpr std::ptrdiff_t chunk_size = 16384;
+		const std::ptrdiff_t total = static_cast<std::ptrdiff_t>(storage_count);
+		T* begin = storage;
+#pragma omp parallel for
+		for (std::ptrdiff_t offset = 0; offset < total; offset += chunk_size)
+		{
+			std::fill_n(begin + offset, std::min(chunk_size, total - offset), value);
+		}
+	}
+	template<typename T>
+	inline void resource<T>::fill_tile(size_t tile_x, size_t tile_y, const T& value)
+	{
+		T* items = tile(tile_x, tile_y);
+		if (layout != resource_layout::linear)
+		{
+			// Tiles are contiguous and padded, so the edge tiles are filled whole too
+			std::fill_n(items, RESOURCE_TILE_SIZE * RESOURCE_TILE_SIZE, value);
+			return;
+		}
+		size_t begin_x = tile_x * RESOURCE_TILE_SIZE;
+		size_t tile_width = std::min(width, begin_x + RESOURCE_TILE_SIZE) - begin_x;
+		size_t tile_height = std::min(height, (tile_y + 1) * RESOURCE_TILE_SIZE) - tile_y * RESOURCE_TILE_SIZE;
+		for (size_t y = 0; y < tile_height; y++)
+		{
+			std::fill_n(items + y * stride, tile_width, value);
+		}
+	}
+	template<typename T>
+	inline void resource<T>::linearize(T* destination, size_t destination_pitch) const
+	{
+		// Every destination row gathers a row of each tile in a strip
+#pragma omp parallel for
+		for (std::ptrdiff_t y = 0; y < static_cast<std::ptrdiff_t>(height); y++)
+		{
+			T* destination_row = destination + y * destination_pitch;
+			if (layout == resource_layout::linear)
+			{
+				std::copy_n(storage + y * stride, width, destination_row);
+				continue;
+			}
+			size_t tile_y = y / RESOURCE_TILE_SIZE;
+			size_t local_y = y % RESOURCE_TILE_SIZE;
+			for (size_t tile_x = 0; tile_x < tiles_x; tile_x++)
+			{
+				const T* items = storage + (tile_y * tiles_x + tile_x) * RESOURCE_TILE_SIZE * RESOURCE_TILE_SIZE;
+				size_t begin_x = tile_x * RESOURCE_TILE_SIZE;
+				size_t tile_width = std::min(width, begin_x + RESOURCE_TILE_SIZE) - begin_x;
+				if (layout == resource_layout::tiled)
+				{
+					std::copy_n(items + local_y * RESOURCE_TILE_SIZE, tile_width, destination_row + begin_x);
+					continue;
+				}
+				for (size_t local_x = 0; local_x < tile_width; local_x++)
+				{
+					destination_row[begin_x + local_x] = items[tile_offset(local_x, local_y)];
+				}
+			}
+		}
+	}
+	template<typename T>
+	inline resource_view<T> resource<T>::view()
+	{
+		return resource_view<T>{storage, storage_count};
+	}
+	template<typename T>
+	inline resource_view_2d<T> resource<T>::view_2d()
+	{
+#ifdef CG_RESOURCE_CHECKS
+		if (layout != resource_layout::linear)
+			THROW_ERROR("2D views need the linear layout");
+#endif
+		return resource_view_2d<T>{storage, width, height, stride};
 	}
 	template<typename T>
 	inline size_t resource<T>::size_bytes() const
@@ -72,7 +423,7 @@ namespace cg
 	template<typename T>
 	inline size_t resource<T>::count() const
 	{
-		return data.size();
+		return storage_count;
 	}
 
 	template<typename T>
@@ -80,6 +431,26 @@ namespace cg
 	{
 		return stride;
 	}
+	template<typename T>
+	inline size_t resource<T>::get_pitch() const
+	{
+		return stride * item_size;
+	}
+	template<typename T>
+	inline size_t resource<T>::get_width() const
+	{
+		return width;
+	}
+	template<typename T>
+	inline size_t resource<T>::get_height() const
+	{
+		return height;
+	}
+	template<typename T>
+	inline resource_layout resource<T>::get_layout() const
+	{
+		return layout;
+	}
 	
 	struct unsigned_color;
 
@@ -135,6 +506,42 @@ namespace cg
 		
 	};
 
+	// 4-byte color, so that pixels never straddle cache lines and are stored with one write
+	struct alignas(4) unsigned_color4
+	{
+		static unsigned_color4 from_color(const color& color)
+		{
+			unsigned_color4 out{};
+			out.r = std::clamp(static_cast<int>(color.r * 255.f), 0, 255);
+			out.g = std::clamp(static_cast<int>(color.g * 255.f), 0, 255);
+			out.b = std::clamp(static_cast<int>(color.b * 255.f), 0, 255);
+			out.a = 255;
+			return out;
+		};
+		static unsigned_color4 from_float3(const float3& color)
+		{
+			float3 preprocessed = clamp(255.f * color, 0.f, 255.f);
+			return unsigned_color4{
+				static_cast<uint8_t>(preprocessed.x),
+				static_cast<uint8_t>(preprocessed.y),
+				static_cast<uint8_t>(preprocessed.z),
+				255,
+			};
+		};
+		float3 to_float3() const
+		{
+			return float3{
+				static_cast<float>(r),
+				static_cast<float>(g),
+				static_cast<float>(b),
+			}/255.f;
+		};
+		uint8_t r;
+		uint8_t g;
+		uint8_t b;
+		uint8_t a;
+	};
+
 	inline color color::from_unsigned_color(const unsigned_color& uc)
 	{
 	    return color{
@@ -146,6 +553,7 @@ namespace cg
 	// };
 
 
+	// Interleaved vertex with its material, only used to upload meshes to the GPU
 	struct vertex
 	{
 		float3 position;
@@ -156,4 +564,49 @@ namespace cg
 		float3 emissive;
 	};
 
+	// Shading attributes of a vertex, the positions are kept in a stream of their own
+	// so that depth-only passes and ray setup don't pull them through the cache
+	struct vertex_attributes
+	{
+		float3 normal;
+		float2 texture;
+	};
+
+	// Compressed vertex streams, see utils/mesh_compression.h. Positions are 16-bit
+	// fractions of the shape bounds, normals are octahedral snorm16 and texture
+	// coordinates are half floats.
+	struct quantized_position
+	{
+		uint16_t x;
+		uint16_t y;
+		uint16_t z;
+	};
+
+	struct packed_vertex_attributes
+	{
+		int16_t normal[2];
+		uint16_t texture[2];
+	};
+
+	// Colors shared by all the triangles of a shape
+	struct material
+	{
+		float3 ambient;
+		float3 diffuse;
+		float3 emissive;
+	};
+
+	// Cluster of neighbouring triangles, a range of the index buffer of its shape.
+	// The bounding sphere and the cone around the triangle normals are in object
+	// space, a cutoff of at most 0 means the normals are too spread for the cone test.
+	struct meshlet
+	{
+		uint32_t index_offset;
+		uint32_t index_count;
+		float3 center;
+		float radius;
+		float3 cone_axis;
+		float cone_cutoff;
+	};
+
 }// namespace cg
\ No newline at end of file
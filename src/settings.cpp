@@ -26,6 +26,26 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("shader_path", "Path to a shader file", cxxopts::value<std::filesystem::path>()->default_value("shaders/shaders.hlsl"));
+	add_options("cull_mode", "Rasterizer face culling: none, front or back", cxxopts::value<std::string>()->default_value("back"));
+	add_options("frustum_culling", "Skip shapes outside of the view frustum", cxxopts::value<bool>()->default_value("true"));
+	add_options("occlusion_culling", "Skip shapes and triangles behind the hierarchical depth buffer", cxxopts::value<bool>()->default_value("true"));
+	add_options("depth_prepass", "Render depth before shading", cxxopts::value<bool>()->default_value("false"));
+	add_options("visibility_buffer", "Rasterize triangle ids and shade each visible pixel once", cxxopts::value<bool>()->default_value("false"));
+	add_options("framebuffer_layout", "Memory layout of the rasterizer buffers: linear, tiled or morton", cxxopts::value<std::string>()->default_value("tiled"));
+	add_options("mesh_cache", "Load models from a binary cache next to the OBJ file, written on the first load", cxxopts::value<bool>()->default_value("false"));
+	add_options("mesh_optimization", "Reorder triangles and vertices of the loaded meshes for vertex cache and fetch locality", cxxopts::value<bool>()->default_value("true"));
+	add_options("mesh_compression", "Rasterize from quantized positions, packed normals and texture coordinates and 16-bit indices", cxxopts::value<bool>()->default_value("false"));
+	add_options("meshlet_culling", "Cull meshlets of about a hundred triangles against the frustum and their normal cones before triangle setup", cxxopts::value<bool>()->default_value("true"));
+	add_options("draw_batching", "Submit all visible shapes as one batch, set up and rasterized tile by tile in parallel, pays off with several cores", cxxopts::value<bool>()->default_value("false"));
+	add_options("instance_count", "Copies of the model laid out on a grid and drawn as instances of its shapes", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("lod_levels", "Levels of detail simplified from every shape at load time, 1 keeps only the full mesh", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("lod_error", "Screen space error in pixels a level of detail may introduce, 0 always renders the full mesh", cxxopts::value<float>()->default_value("0"));
+	add_options("textures", "Load the diffuse textures of the materials and sample them in the shaders", cxxopts::value<bool>()->default_value("true"));
+	add_options("texture_filter", "Texture filtering: bilinear from the nearest mip level or trilinear between two", cxxopts::value<std::string>()->default_value("trilinear"));
+	add_options("texture_streaming", "Draw with the textures decoded so far instead of waiting for the background decode of all of them", cxxopts::value<bool>()->default_value("false"));
+	add_options("texture_budget", "Megabytes of full mip chains kept resident, the least recently used ones fall back to their small levels", cxxopts::value<unsigned>()->default_value("512"));
+	add_options("transparency", "Blending of the surfaces with alpha below 1: background blends against the clear color, weighted blends all the surfaces order-independently", cxxopts::value<std::string>()->default_value("weighted"));
+	add_options("msaa", "Samples per pixel of the rasterizer: 1, or 4 and 8 for multisample anti-aliasing", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("alpha", "Transparency value (0.0-1.0)", cxxopts::value<float>()->default_value("1.0"));
 	add_options("noise_amplitude", "Amplitude of surface noise (0.0-1.0)", cxxopts::value<float>()->default_value("0.1"));
 	add_options("noise_frequency", "Frequency of surface noise", cxxopts::value<float>()->default_value("0.05"));
@@ -51,6 +71,26 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
 	settings->shader_path = result["shader_path"].as<std::filesystem::path>();
+	settings->cull_mode = result["cull_mode"].as<std::string>();
+	settings->frustum_culling = result["frustum_culling"].as<bool>();
+	settings->occlusion_culling = result["occlusion_culling"].as<bool>();
+	settings->depth_prepass = result["depth_prepass"].as<bool>();
+	settings->visibility_buffer = result["visibility_buffer"].as<bool>();
+	settings->framebuffer_layout = result["framebuffer_layout"].as<std::string>();
+	settings->mesh_cache = result["mesh_cache"].as<bool>();
+	settings->mesh_optimization = result["mesh_optimization"].as<bool>();
+	settings->mesh_compression = result["mesh_compression"].as<bool>();
+	settings->meshlet_culling = result["meshlet_culling"].as<bool>();
+	settings->draw_batching = result["draw_batching"].as<bool>();
+	settings->instance_count = result["instance_count"].as<unsigned>();
+	settings->lod_levels = result["lod_levels"].as<unsigned>();
+	settings->lod_error = result["lod_error"].as<float>();
+	settings->textures = result["textures"].as<bool>();
+	settings->texture_filter = result["texture_filter"].as<std::string>();
+	settings->texture_streaming = result["texture_streaming"].as<bool>();
+	settings->texture_budget = result["texture_budget"].as<unsigned>();
+	settings->transparency = result["transparency"].as<std::string>();
+	settings->msaa = result["msaa"].as<unsigned>();
 	settings->alpha = result["alpha"].as<float>();
 	settings->noise_amplitude = result["noise_amplitude"].as<float>();
 	settings->noise_frequency = result["noise_frequency"].as<float>();
@@ -29,6 +29,27 @@ namespace cg
 		unsigned accumulation_num;
 
 		std::filesystem::path shader_path;
+
+		std::string cull_mode;
+		bool frustum_culling;
+		bool occlusion_culling;
+		bool depth_prepass;
+		bool visibility_buffer;
+		std::string framebuffer_layout;
+		bool mesh_cache;
+		bool mesh_optimization;
+		bool mesh_compression;
+		bool meshlet_culling;
+		bool draw_batching;
+		unsigned instance_count;
+		unsigned lod_levels;
+		float lod_error;
+		bool textures;
+		std::string texture_filter;
+		bool texture_streaming;
+		unsigned texture_budget;
+		std::string transparency;
+		unsigned msaa;
 		
 		// Parameter for transparency
 		float alpha = 0.5f;
@@ -0,0 +1,234 @@
+#pragma once
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <omp.h>
+#include <type_traits>
+#include <vector>
+
+
+namespace cg::utils
+{
+	constexpr size_t DEFAULT_ARENA_BLOCK_SIZE = 1024 * 1024;
+
+	struct arena_statistics
+	{
+		// Allocations served since the last reset
+		size_t allocations = 0;
+		size_t used_bytes = 0;
+		// Blocks the arena took from the heap since the last reset, zero once it's warm.
+		// Heap allocations outside of the arena aren't counted.
+		size_t block_allocations = 0;
+		size_t capacity = 0;
+
+		arena_statistics& operator+=(const arena_statistics& other)
+		{
+			allocations += other.allocations;
+			used_bytes += other.used_bytes;
+			block_allocations += other.block_allocations;
+			capacity += other.capacity;
+			return *this;
+		}
+	};
+
+	// Bump-pointer allocator for transient data. Memory comes from the heap in
+	// blocks, reset() makes all of them reusable at once without freeing, so a
+	// frame that fits into the blocks of the previous one doesn't touch the heap.
+	// Destructors of the allocated objects are never called.
+	class arena
+	{
+	public:
+		explicit arena(size_t in_block_size = DEFAULT_ARENA_BLOCK_SIZE);
+		~arena();
+
+		arena(const arena&) = delete;
+		arena& operator=(const arena&) = delete;
+
+		void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t));
+		template<typename T>
+		T* allocate_array(size_t count);
+		void reset();
+
+		const arena_statistics& get_statistics() const;
+
+	protected:
+		struct block
+		{
+			char* data;
+			size_t size;
+		};
+		std::vector<block> blocks;
+		size_t current_block = 0;
+		size_t offset = 0;
+		size_t block_size;
+
+		arena_statistics statistics;
+	};
+
+	inline arena::arena(size_t in_block_size) : block_size(in_block_size)
+	{
+		blocks.push_back(block{static_cast<char*>(std::malloc(block_size)), block_size});
+		if (!blocks.back().data)
+			THROW_ERROR("Can't allocate an arena block");
+		statistics.capacity = block_size;
+	}
+
+	inline arena::~arena()
+	{
+		for (auto& block: blocks)
+		{
+			std::free(block.data);
+		}
+	}
+
+	inline void* arena::allocate(size_t bytes, size_t alignment)
+	{
+		while (true)
+		{
+			block& current = blocks[current_block];
+			uintptr_t address = reinterpret_cast<uintptr_t>(current.data) + offset;
+			size_t padding = (alignment - address % alignment) % alignment;
+			if (offset + padding + bytes <= current.size)
+			{
+				void* result = current.data + offset + padding;
+				offset += padding + bytes;
+				statistics.allocations++;
+				statistics.used_bytes += padding + bytes;
+				return result;
+			}
+			if (current_block + 1 < blocks.size())
+			{
+				current_block++;
+				offset = 0;
+				continue;
+			}
+
+			// None of the blocks fits, the new one is kept for the next frames
+			size_t size = std::max(block_size, bytes + alignment);
+			char* data = static_cast<char*>(std::malloc(size));
+			if (!data)
+				THROW_ERROR("Can't allocate an arena block");
+			blocks.push_back(block{data, size});
+			current_block = blocks.size() - 1;
+			offset = 0;
+			statistics.block_allocations++;
+			statistics.capacity += size;
+		}
+	}
+
+	template<typename T>
+	inline T* arena::allocate_array(size_t count)
+	{
+		static_assert(std::is_trivially_destructible_v<T>, "Arena objects are never destroyed");
+		T* items = static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+		std::uninitialized_value_construct_n(items, count);
+		return items;
+	}
+
+	inline void arena::reset()
+	{
+		current_block = 0;
+		offset = 0;
+		statistics.allocations = 0;
+		statistics.used_bytes = 0;
+		statistics.block_allocations = 0;
+	}
+
+	inline const arena_statistics& arena::get_statistics() const
+	{
+		return statistics;
+	}
+
+	// Lets the standard containers live in an arena, deallocation is a no-op
+	template<typename T>
+	class arena_allocator
+	{
+	public:
+		using value_type = T;
+
+		arena_allocator(arena& in_arena) : owner(&in_arena) {}
+		template<typename U>
+		arena_allocator(const arena_allocator<U>& other) : owner(other.get_arena()) {}
+
+		T* allocate(size_t count)
+		{
+			return static_cast<T*>(owner->allocate(count * sizeof(T), alignof(T)));
+		}
+		void deallocate(T*, size_t) {}
+
+		arena* get_arena() const
+		{
+			return owner;
+		}
+
+		template<typename U>
+		bool operator==(const arena_allocator<U>& other) const
+		{
+			return owner == other.get_arena();
+		}
+		template<typename U>
+		bool operator!=(const arena_allocator<U>& other) const
+		{
+			return owner != other.get_arena();
+		}
+
+	protected:
+		arena* owner;
+	};
+
+	template<typename T>
+	using arena_vector = std::vector<T, arena_allocator<T>>;
+
+	// An arena per OpenMP thread for the data of the current frame, all of them
+	// are reset at the end of the frame
+	class frame_arenas
+	{
+	public:
+		explicit frame_arenas(size_t block_size = DEFAULT_ARENA_BLOCK_SIZE);
+
+		arena& get();
+		void reset();
+
+		arena_statistics get_statistics() const;
+
+	protected:
+		std::vector<std::unique_ptr<arena>> arenas;
+	};
+
+	inline frame_arenas::frame_arenas(size_t block_size)
+	{
+		arenas.resize(omp_get_max_threads());
+		for (auto& thread_arena: arenas)
+		{
+			thread_arena = std::make_unique<arena>(block_size);
+		}
+	}
+
+	inline arena& frame_arenas::get()
+	{
+		return *arenas[omp_get_thread_num()];
+	}
+
+	inline void frame_arenas::reset()
+	{
+		for (auto& thread_arena: arenas)
+		{
+			thread_arena->reset();
+		}
+	}
+
+	inline arena_statistics frame_arenas::get_statistics() const
+	{
+		arena_statistics result;
+		for (const auto& thread_arena: arenas)
+		{
+			result += thread_arena->get_statistics();
+		}
+		return result;
+	}
+}// namespace cg::utils
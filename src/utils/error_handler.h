@@ -1,5 +1,6 @@
 #pragma once
 
+#include <exception>
 #include <stdexcept>
 #include <string>
 
@@ -14,3 +15,13 @@
 				.append("\n");                    \
 		throw std::runtime_error(message);        \
 	}
+
+// Message of an exception without the line break THROW_ERROR ends it with, so
+// every caller can end the line itself whatever threw
+inline std::string error_message(const std::exception& exception)
+{
+	std::string message(exception.what());
+	while (!message.empty() && (message.back() == '\n' || message.back() == '\r'))
+		message.pop_back();
+	return message;
+}
@@ -0,0 +1,104 @@
+#include "mapped_file.h"
+
+#include "utils/error_handler.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+using namespace cg::utils;
+
+#ifdef _WIN32
+
+mapped_file::mapped_file(const std::filesystem::path& path)
+{
+	file_handle = CreateFileW(
+			path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		THROW_ERROR("Can't open " + path.string());
+
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file_handle, &file_size);
+	length = static_cast<size_t>(file_size.QuadPart);
+	if (length == 0)
+		return;
+
+	mapping_handle = CreateFileMappingW(file_handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	if (!mapping_handle)
+	{
+		CloseHandle(file_handle);
+		THROW_ERROR("Can't map " + path.string());
+	}
+	view = static_cast<char*>(MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, 0));
+	if (!view)
+	{
+		CloseHandle(mapping_handle);
+		CloseHandle(file_handle);
+		THROW_ERROR("Can't map " + path.string());
+	}
+}
+
+mapped_file::~mapped_file()
+{
+	if (view)
+		UnmapViewOfFile(view);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle && file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+}
+
+#else
+
+mapped_file::mapped_file(const std::filesystem::path& path)
+{
+	descriptor = open(path.c_str(), O_RDONLY);
+	if (descriptor < 0)
+		THROW_ERROR("Can't open " + path.string());
+
+	struct stat file_stat;
+	fstat(descriptor, &file_stat);
+	length = static_cast<size_t>(file_stat.st_size);
+	if (length == 0)
+		return;
+
+	void* mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+	if (mapping == MAP_FAILED)
+	{
+		close(descriptor);
+		THROW_ERROR("Can't map " + path.string());
+	}
+	view = static_cast<char*>(mapping);
+}
+
+mapped_file::~mapped_file()
+{
+	if (view)
+		munmap(view, length);
+	if (descriptor >= 0)
+		close(descriptor);
+}
+
+#endif
+
+char* mapped_file::data()
+{
+	return view;
+}
+
+const char* mapped_file::data() const
+{
+	return view;
+}
+
+size_t mapped_file::size() const
+{
+	return length;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+
+
+namespace cg::utils
+{
+	// A whole file mapped into memory. The pages are private copy-on-write, so
+	// data built on top of the mapping may be written without touching the file.
+	class mapped_file
+	{
+	public:
+		explicit mapped_file(const std::filesystem::path& path);
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		char* data();
+		const char* data() const;
+		size_t size() const;
+
+	private:
+		char* view = nullptr;
+		size_t length = 0;
+#ifdef _WIN32
+		void* file_handle = nullptr;
+		void* mapping_handle = nullptr;
+#else
+		int descriptor = -1;
+#endif
+	};
+}// namespace cg::utils
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "resource.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <linalg.h>
+
+
+using namespace linalg::aliases;
+
+namespace cg::utils
+{
+	constexpr float POSITION_QUANTIZATION_STEPS = 65535.f;
+	constexpr float SNORM16_SCALE = 32767.f;
+
+	inline uint16_t float_to_half(float value)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		uint32_t sign = (bits >> 16) & 0x8000u;
+		int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xffu) - 127 + 15;
+		uint32_t mantissa = bits & 0x7fffffu;
+
+		// NaNs and infinities, then values too big for a half
+		if (((bits >> 23) & 0xffu) == 0xffu)
+			return static_cast<uint16_t>(sign | 0x7c00u | (mantissa ? 0x200u : 0u));
+		if (exponent >= 31)
+			return static_cast<uint16_t>(sign | 0x7c00u);
+		// Subnormal halves keep the implicit bit in the mantissa
+		if (exponent <= 0)
+		{
+			if (exponent < -10)
+				return static_cast<uint16_t>(sign);
+			mantissa |= 0x800000u;
+			uint32_t shift = static_cast<uint32_t>(14 - exponent);
+			uint32_t half_mantissa = mantissa >> shift;
+			uint32_t remainder = mantissa & ((1u << shift) - 1u);
+			uint32_t halfway = 1u << (shift - 1);
+			if (remainder > halfway || (remainder == halfway && (half_mantissa & 1u)))
+				half_mantissa++;
+			return static_cast<uint16_t>(sign | half_mantissa);
+		}
+
+		// Round to nearest even, a carry into the exponent is still a valid encoding
+		uint32_t half = sign | (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+		uint32_t remainder = mantissa & 0x1fffu;
+		if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u)))
+			half++;
+		return static_cast<uint16_t>(half);
+	}
+
+	inline float half_to_float(uint16_t half)
+	{
+		uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+		uint32_t exponent = (half >> 10) & 0x1fu;
+		uint32_t mantissa = half & 0x3ffu;
+
+		uint32_t bits;
+		if (exponent == 0x1fu)
+		{
+			bits = sign | 0x7f800000u | (mantissa << 13);
+		}
+		else if (exponent != 0)
+		{
+			bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+		}
+		else if (mantissa == 0)
+		{
+			bits = sign;
+		}
+		else
+		{
+			// Subnormal, normalized for the float
+			exponent = 127 - 15 + 1;
+			while (!(mantissa & 0x400u))
+			{
+				mantissa <<= 1;
+				exponent--;
+			}
+			bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+		}
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	inline int16_t float_to_snorm16(float value)
+	{
+		return static_cast<int16_t>(std::round(std::clamp(value, -1.f, 1.f) * SNORM16_SCALE));
+	}
+
+	inline float snorm16_to_float(int16_t value)
+	{
+		return std::max(static_cast<float>(value) / SNORM16_SCALE, -1.f);
+	}
+
+	// Unit vectors are projected onto the octahedron |x| + |y| + |z| = 1, its
+	// lower half is folded over the upper one, so the normal fits into a square.
+	// Zero and non-finite normals, e.g. of degenerate faces, encode as +Z.
+	inline float2 octahedral_encode(const float3& normal)
+	{
+		float length = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+		if (!std::isfinite(length) || length < 1e-20f)
+			return float2{0.f, 0.f};
+		float3 n = normal / length;
+		float2 result{n.x, n.y};
+		if (n.z < 0.f)
+		{
+			result = float2{
+					(1.f - std::abs(n.y)) * (n.x >= 0.f ? 1.f : -1.f),
+					(1.f - std::abs(n.x)) * (n.y >= 0.f ? 1.f : -1.f)};
+		}
+		return result;
+	}
+
+	inline float3 octahedral_decode(const float2& encoded)
+	{
+		float3 n{encoded.x, encoded.y, 1.f - std::abs(encoded.x) - std::abs(encoded.y)};
+		float fold = std::max(-n.z, 0.f);
+		n.x += n.x >= 0.f ? -fold : fold;
+		n.y += n.y >= 0.f ? -fold : fold;
+		return normalize(n);
+	}
+
+	inline cg::packed_vertex_attributes pack_vertex_attributes(const cg::vertex_attributes& attributes)
+	{
+		float2 normal = octahedral_encode(attributes.normal);
+		return cg::packed_vertex_attributes{
+				{float_to_snorm16(normal.x), float_to_snorm16(normal.y)},
+				{float_to_half(attributes.texture.x), float_to_half(attributes.texture.y)}};
+	}
+
+	inline cg::vertex_attributes unpack_vertex_attributes(const cg::packed_vertex_attributes& packed)
+	{
+		return cg::vertex_attributes{
+				octahedral_decode(float2{snorm16_to_float(packed.normal[0]), snorm16_to_float(packed.normal[1])}),
+				float2{half_to_float(packed.texture[0]), half_to_float(packed.texture[1])}};
+	}
+
+	// Positions are stored as 16-bit fractions of the bounding box of their shape
+	inline cg::quantized_position quantize_position(const float3& position, const float3& aabb_min, const float3& aabb_max)
+	{
+		float3 extent = aabb_max - aabb_min;
+		auto quantize = [](float value, float min_value, float range) {
+			if (range <= 0.f)
+				return uint16_t{0};
+			float steps = std::round((value - min_value) / range * POSITION_QUANTIZATION_STEPS);
+			return static_cast<uint16_t>(std::clamp(steps, 0.f, POSITION_QUANTIZATION_STEPS));
+		};
+		return cg::quantized_position{
+				quantize(position.x, aabb_min.x, extent.x),
+				quantize(position.y, aabb_min.y, extent.y),
+				quantize(position.z, aabb_min.z, extent.z)};
+	}
+
+	// Maps the quantized positions back to object space, it's meant to be folded
+	// into the transformation matrix so that the decode costs nothing per vertex
+	inline float4x4 dequantization_matrix(const float3& aabb_min, const float3& aabb_max)
+	{
+		float3 scale = (aabb_max - aabb_min) / POSITION_QUANTIZATION_STEPS;
+		return float4x4{
+				{scale.x, 0, 0, 0},
+				{0, scale.y, 0, 0},
+				{0, 0, scale.z, 0},
+				{aabb_min.x, aabb_min.y, aabb_min.z, 1}};
+	}
+}// namespace cg::utils
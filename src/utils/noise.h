@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <linalg.h>
+
+
+using namespace linalg::aliases;
+
+// Stateless noise from integer hashes. Every function only depends on its
+// arguments, so shaders can call them from any number of threads and get the
+// same image every time. There are no tables or branches on the hashed
+// values, which keeps the loops over pixels vectorizable.
+namespace cg::utils
+{
+	// Integer finalizer with a low bias, every input bit affects every output bit
+	inline uint32_t hash(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+
+	inline uint32_t hash(uint32_t x, uint32_t y)
+	{
+		return hash(x ^ hash(y + 0x9e3779b9u));
+	}
+
+	inline uint32_t hash(uint32_t x, uint32_t y, uint32_t z)
+	{
+		return hash(x ^ hash(y ^ (hash(z + 0x9e3779b9u) + 0x9e3779b9u)));
+	}
+
+	inline uint32_t float_bits(float value)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	// Upper 24 bits of the hash mapped to [-1, 1)
+	inline float hash_to_signed_float(uint32_t hash)
+	{
+		return static_cast<float>(hash >> 8) * (2.f / 16777216.f) - 1.f;
+	}
+
+	// Uncorrelated value in [-1, 1) for every pixel
+	inline float white_noise(const int2& pixel, uint32_t seed = 0)
+	{
+		return hash_to_signed_float(hash(static_cast<uint32_t>(pixel.x), static_cast<uint32_t>(pixel.y), seed));
+	}
+
+	namespace noise_detail
+	{
+		// Quintic fade of Perlin, its first and second derivatives are 0 at the lattice points
+		inline float fade(float t)
+		{
+			return t * t * t * (t * (t * 6.f - 15.f) + 10.f);
+		}
+
+		inline float lerp(float a, float b, float t)
+		{
+			return a + (b - a) * t;
+		}
+
+		inline uint32_t lattice_hash(int x, int y, int z, uint32_t seed)
+		{
+			return hash(static_cast<uint32_t>(x), static_cast<uint32_t>(y), static_cast<uint32_t>(z) ^ seed);
+		}
+
+		// Dot product with one of the 12 directions to the edges of a cube, picked by the
+		// top 4 bits of the hash, four of them twice like in improved Perlin noise
+		inline float gradient(uint32_t hash, float x, float y, float z)
+		{
+			uint32_t h = hash >> 28;
+			float u = h < 8u ? x : y;
+			float v = h < 4u ? y : (h == 12u || h == 14u ? x : z);
+			return ((h & 1u) ? -u : u) + ((h & 2u) ? -v : v);
+		}
+	}// namespace noise_detail
+
+	// Smooth interpolation of random values at the integer lattice, in [-1, 1]
+	inline float value_noise(const float3& position, uint32_t seed = 0)
+	{
+		using namespace noise_detail;
+		float3 cell{std::floor(position.x), std::floor(position.y), std::floor(position.z)};
+		int x = static_cast<int>(cell.x);
+		int y = static_cast<int>(cell.y);
+		int z = static_cast<int>(cell.z);
+		float3 t = position - cell;
+		float u = fade(t.x);
+		float v = fade(t.y);
+		float w = fade(t.z);
+
+		auto corner = [&](int dx, int dy, int dz) {
+			return hash_to_signed_float(lattice_hash(x + dx, y + dy, z + dz, seed));
+		};
+		float near_plane = lerp(lerp(corner(0, 0, 0), corner(1, 0, 0), u), lerp(corner(0, 1, 0), corner(1, 1, 0), u), v);
+		float far_plane = lerp(lerp(corner(0, 0, 1), corner(1, 0, 1), u), lerp(corner(0, 1, 1), corner(1, 1, 1), u), v);
+		return lerp(near_plane, far_plane, w);
+	}
+
+	// Perlin noise with hashed gradients, 0 at the lattice points and about [-1, 1]
+	inline float gradient_noise(const float3& position, uint32_t seed = 0)
+	{
+		using namespace noise_detail;
+		float3 cell{std::floor(position.x), std::floor(position.y), std::floor(position.z)};
+		int x = static_cast<int>(cell.x);
+		int y = static_cast<int>(cell.y);
+		int z = static_cast<int>(cell.z);
+		float3 t = position - cell;
+		float u = fade(t.x);
+		float v = fade(t.y);
+		float w = fade(t.z);
+
+		auto corner = [&](int dx, int dy, int dz) {
+			return gradient(lattice_hash(x + dx, y + dy, z + dz, seed),
+							t.x - static_cast<float>(dx), t.y - static_cast<float>(dy), t.z - static_cast<float>(dz));
+		};
+		float near_plane = lerp(lerp(corner(0, 0, 0), corner(1, 0, 0), u), lerp(corner(0, 1, 0), corner(1, 1, 0), u), v);
+		float far_plane = lerp(lerp(corner(0, 0, 1), corner(1, 0, 1), u), lerp(corner(0, 1, 1), corner(1, 1, 1), u), v);
+		return lerp(near_plane, far_plane, w);
+	}
+}// namespace cg::utils
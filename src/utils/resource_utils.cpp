@@ -6,6 +6,7 @@
 #include "utils/error_handler.h"
 
 #include <stb_image_write.h>
+#include <vector>
 
 
 using namespace cg::utils;
@@ -21,14 +22,27 @@ std::string view_command(const std::filesystem::path& path)
 	return "";
 }
 
-void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath)
+template<typename T>
+void save_png(cg::resource<T>& render_target, int components, const std::filesystem::path& filepath)
 {
-	int width = static_cast<int>(render_target.get_stride());
-	int height = static_cast<int>(render_target.count()) / width;
+	int width = static_cast<int>(render_target.get_width());
+	int height = static_cast<int>(render_target.get_height());
+
+	const T* data = render_target.get_data();
+	int pitch = static_cast<int>(render_target.get_pitch());
+	// Tiled layouts are copied to rows first
+	std::vector<T> linear;
+	if (render_target.get_layout() != cg::resource_layout::linear)
+	{
+		linear.resize(render_target.get_width() * render_target.get_height());
+		render_target.linearize(linear.data(), render_target.get_width());
+		data = linear.data();
+		pitch = static_cast<int>(render_target.get_width() * sizeof(T));
+	}
 
+	// The pitch skips the padding at the end of the rows
 	int result = stbi_write_png(
-			filepath.string().c_str(), width, height, 3, render_target.get_data(),
-			width * sizeof(cg::unsigned_color));
+			filepath.string().c_str(), width, height, components, data, pitch);
 
 	if (result != 1)
 		THROW_ERROR("Can't save the resource");
@@ -38,3 +52,13 @@ void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, s
 		std::system(command.c_str());
 }
 
+void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath)
+{
+	save_png(render_target, 3, filepath);
+}
+
+void cg::utils::save_resource(cg::resource<cg::unsigned_color4>& render_target, std::filesystem::path filepath)
+{
+	save_png(render_target, 4, filepath);
+}
+
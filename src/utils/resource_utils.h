@@ -8,4 +8,5 @@
 namespace cg::utils
 {
 	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath);
+	void save_resource(cg::resource<cg::unsigned_color4>& render_target, std::filesystem::path filepath);
 }
\ No newline at end of file
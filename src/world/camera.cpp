@@ -4,6 +4,7 @@
 
 #include "utils/error_handler.h"
 
+#include <algorithm>
 #include <math.h>
 
 
@@ -109,6 +110,65 @@ const float4x4 cg::world::camera::get_projection_matrix() const
 	};
 }
 
+const frustum cg::world::camera::get_frustum(const float4x4& world_matrix) const
+{
+	return frustum::from_matrix(mul(get_projection_matrix(), get_view_matrix(), world_matrix));
+}
+
+const float cg::world::camera::get_projected_size(float size, float distance) const
+{
+	float pixels_per_unit = height / (2.f * std::tanf(angle_of_view / 2.f));
+	return size * pixels_per_unit / std::max(distance, z_near);
+}
+
+frustum cg::world::frustum::from_matrix(const float4x4& matrix)
+{
+	// Gribb-Hartmann extraction, clip space z is in [0, w] for our projection
+	float4 row_x = matrix.row(0);
+	float4 row_y = matrix.row(1);
+	float4 row_z = matrix.row(2);
+	float4 row_w = matrix.row(3);
+
+	frustum result{};
+	result.planes[0] = row_w + row_x;
+	result.planes[1] = row_w - row_x;
+	result.planes[2] = row_w + row_y;
+	result.planes[3] = row_w - row_y;
+	result.planes[4] = row_z;
+	result.planes[5] = row_w - row_z;
+
+	for (auto& plane: result.planes)
+	{
+		plane /= length(plane.xyz());
+	}
+	return result;
+}
+
+bool cg::world::frustum::is_sphere_visible(const float3& center, float radius) const
+{
+	for (const auto& plane: planes)
+	{
+		if (dot(plane.xyz(), center) + plane.w < -radius)
+			return false;
+	}
+	return true;
+}
+
+bool cg::world::frustum::is_aabb_visible(const float3& aabb_min, const float3& aabb_max) const
+{
+	for (const auto& plane: planes)
+	{
+		// Test the corner that lies furthest along the plane normal
+		float3 positive_vertex{
+				plane.x >= 0.f ? aabb_max.x : aabb_min.x,
+				plane.y >= 0.f ? aabb_max.y : aabb_min.y,
+				plane.z >= 0.f ? aabb_max.z : aabb_min.z};
+		if (dot(plane.xyz(), positive_vertex) + plane.w < 0.f)
+			return false;
+	}
+	return true;
+}
+
 const float3 cg::world::camera::get_position() const
 {
 	return position;
@@ -10,6 +10,17 @@ using namespace linalg::aliases;
 
 namespace cg::world
 {
+	// View volume as six inward-facing planes (left, right, bottom, top, near, far)
+	struct frustum
+	{
+		static frustum from_matrix(const float4x4& matrix);
+
+		bool is_sphere_visible(const float3& center, float radius) const;
+		bool is_aabb_visible(const float3& aabb_min, const float3& aabb_max) const;
+
+		float4 planes[6];
+	};
+
 	class camera
 	{
 	public:
@@ -28,6 +39,9 @@ namespace cg::world
 
 		const float4x4 get_view_matrix() const;
 		const float4x4 get_projection_matrix() const;
+		const frustum get_frustum(const float4x4& world_matrix) const;
+		// Height in pixels of a world space length seen from the given distance
+		const float get_projected_size(float size, float distance) const;
 
 #ifdef DX12
 		const DirectX::XMMATRIX get_dxm_view_matrix() const;
@@ -0,0 +1,231 @@
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <vector>
+
+
+float cg::world::compute_acmr(const unsigned int* indices, size_t num_indices, size_t num_vertices, size_t cache_size)
+{
+	if (num_indices < 3)
+		return 0.f;
+
+	// A vertex is in the cache while fewer than cache_size misses happened since it was loaded
+	std::vector<size_t> load_time(num_vertices, 0);
+	size_t misses = 0;
+	for (size_t i = 0; i < num_indices; i++)
+	{
+		unsigned int vertex = indices[i];
+		if (load_time[vertex] == 0 || misses - load_time[vertex] >= cache_size)
+		{
+			misses++;
+			load_time[vertex] = misses;
+		}
+	}
+	return static_cast<float>(misses) / static_cast<float>(num_indices / 3);
+}
+
+void cg::world::optimize_vertex_cache(unsigned int* indices, size_t num_indices, size_t num_vertices, size_t cache_size)
+{
+	size_t num_triangles = num_indices / 3;
+	if (num_triangles == 0)
+		return;
+
+	// Triangles around every vertex, as offsets into one array
+	std::vector<unsigned int> live_triangles(num_vertices, 0);
+	for (size_t i = 0; i < num_indices; i++)
+		live_triangles[indices[i]]++;
+	std::vector<size_t> adjacency_offsets(num_vertices + 1, 0);
+	for (size_t v = 0; v < num_vertices; v++)
+		adjacency_offsets[v + 1] = adjacency_offsets[v] + live_triangles[v];
+	std::vector<unsigned int> adjacency(num_indices);
+	std::vector<size_t> fill = adjacency_offsets;
+	for (size_t i = 0; i < num_indices; i++)
+		adjacency[fill[indices[i]]++] = static_cast<unsigned int>(i / 3);
+
+	std::vector<unsigned int> result;
+	result.reserve(num_indices);
+	std::vector<char> emitted(num_triangles, 0);
+	// Time stamps of the vertices in the simulated cache, the clock starts past the cache size
+	std::vector<size_t> cache_time(num_vertices, 0);
+	size_t time = cache_size + 1;
+	std::vector<unsigned int> dead_end;
+	std::vector<unsigned int> candidates;
+	size_t cursor = 0;
+
+	auto next_live_vertex = [&]() -> long long {
+		// Vertices of the last triangles first, they are likely still in the cache
+		while (!dead_end.empty())
+		{
+			unsigned int vertex = dead_end.back();
+			dead_end.pop_back();
+			if (live_triangles[vertex] > 0)
+				return vertex;
+		}
+		while (cursor < num_vertices)
+		{
+			if (live_triangles[cursor] > 0)
+				return static_cast<long long>(cursor++);
+			cursor++;
+		}
+		return -1;
+	};
+
+	long long fanning = next_live_vertex();
+	while (fanning >= 0)
+	{
+		candidates.clear();
+		for (size_t a = adjacency_offsets[fanning]; a < adjacency_offsets[fanning + 1]; a++)
+		{
+			unsigned int triangle = adjacency[a];
+			if (emitted[triangle])
+				continue;
+			emitted[triangle] = 1;
+			for (size_t k = 0; k < 3; k++)
+			{
+				unsigned int vertex = indices[3 * triangle + k];
+				result.push_back(vertex);
+				dead_end.push_back(vertex);
+				candidates.push_back(vertex);
+				live_triangles[vertex]--;
+				if (time - cache_time[vertex] > cache_size)
+				{
+					cache_time[vertex] = time;
+					time++;
+				}
+			}
+		}
+
+		// The next fan is around the candidate that stays in the cache the longest
+		// while its remaining triangles are emitted
+		long long best = -1;
+		size_t best_priority = 0;
+		for (unsigned int vertex: candidates)
+		{
+			if (live_triangles[vertex] == 0)
+				continue;
+			size_t priority = 0;
+			if (time - cache_time[vertex] + 2 * live_triangles[vertex] <= cache_size)
+				priority = time - cache_time[vertex];
+			if (best < 0 || priority > best_priority)
+			{
+				best = vertex;
+				best_priority = priority;
+			}
+		}
+		fanning = best >= 0 ? best : next_live_vertex();
+	}
+
+	std::copy(result.begin(), result.end(), indices);
+}
+
+void cg::world::optimize_vertex_fetch(
+		unsigned int* indices, size_t num_indices,
+		float3* positions, cg::vertex_attributes* attributes, size_t num_vertices)
+{
+	constexpr unsigned int unused = ~0u;
+	std::vector<unsigned int> remap(num_vertices, unused);
+	unsigned int next = 0;
+	for (size_t i = 0; i < num_indices; i++)
+	{
+		unsigned int& vertex = remap[indices[i]];
+		if (vertex == unused)
+			vertex = next++;
+		indices[i] = vertex;
+	}
+	// Vertices no triangle uses go to the end
+	for (auto& vertex: remap)
+	{
+		if (vertex == unused)
+			vertex = next++;
+	}
+
+	std::vector<float3> old_positions(positions, positions + num_vertices);
+	std::vector<cg::vertex_attributes> old_attributes(attributes, attributes + num_vertices);
+	for (size_t v = 0; v < num_vertices; v++)
+	{
+		positions[remap[v]] = old_positions[v];
+		attributes[remap[v]] = old_attributes[v];
+	}
+}
+
+std::vector<cg::meshlet> cg::world::build_meshlets(
+		const unsigned int* indices, size_t num_indices,
+		const float3* positions, size_t num_vertices,
+		size_t max_vertices, size_t max_triangles)
+{
+	std::vector<cg::meshlet> meshlets;
+	// Marks the vertices of the current meshlet with its number plus one
+	std::vector<size_t> owner(num_vertices, 0);
+	std::vector<unsigned int> vertices;
+
+	auto finish = [&](size_t begin, size_t end) {
+		cg::meshlet result{};
+		result.index_offset = static_cast<uint32_t>(begin);
+		result.index_count = static_cast<uint32_t>(end - begin);
+
+		// The sphere is centered at the box of the vertices, like the shape bounds
+		float3 aabb_min = positions[vertices[0]];
+		float3 aabb_max = aabb_min;
+		for (unsigned int vertex: vertices)
+		{
+			aabb_min = min(aabb_min, positions[vertex]);
+			aabb_max = max(aabb_max, positions[vertex]);
+		}
+		result.center = (aabb_min + aabb_max) * 0.5f;
+		for (unsigned int vertex: vertices)
+			result.radius = std::max(result.radius, length(positions[vertex] - result.center));
+
+		// The cone axis is the area weighted average normal, the cutoff is the cosine
+		// of the widest angle between the axis and a triangle normal
+		float3 normal_sum{0.f, 0.f, 0.f};
+		for (size_t i = begin; i < end; i += 3)
+		{
+			const float3& a = positions[indices[i]];
+			normal_sum += cross(positions[indices[i + 1]] - a, positions[indices[i + 2]] - a);
+		}
+		result.cone_cutoff = -1.f;
+		float sum_length = length(normal_sum);
+		if (sum_length > 0.f)
+		{
+			result.cone_axis = normal_sum / sum_length;
+			result.cone_cutoff = 1.f;
+			for (size_t i = begin; i < end; i += 3)
+			{
+				const float3& a = positions[indices[i]];
+				float3 normal = cross(positions[indices[i + 1]] - a, positions[indices[i + 2]] - a);
+				float normal_length = length(normal);
+				if (normal_length > 0.f)
+					result.cone_cutoff = std::min(result.cone_cutoff, dot(result.cone_axis, normal) / normal_length);
+			}
+		}
+		meshlets.push_back(result);
+		vertices.clear();
+	};
+
+	size_t begin = 0;
+	for (size_t i = 0; i + 2 < num_indices; i += 3)
+	{
+		size_t stamp = meshlets.size() + 1;
+		size_t new_vertices = 0;
+		for (size_t k = 0; k < 3; k++)
+			new_vertices += owner[indices[i + k]] != stamp;
+		if (i > begin && (vertices.size() + new_vertices > max_vertices || (i - begin) / 3 >= max_triangles))
+		{
+			finish(begin, i);
+			begin = i;
+			stamp = meshlets.size() + 1;
+		}
+		for (size_t k = 0; k < 3; k++)
+		{
+			unsigned int vertex = indices[i + k];
+			if (owner[vertex] != stamp)
+			{
+				owner[vertex] = stamp;
+				vertices.push_back(vertex);
+			}
+		}
+	}
+	if (num_indices - num_indices % 3 > begin)
+		finish(begin, num_indices - num_indices % 3);
+	return meshlets;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "resource.h"
+
+#include <cstddef>
+#include <linalg.h>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::world
+{
+	// Size of the FIFO post-transform cache the optimizer and the statistics assume
+	constexpr size_t VERTEX_CACHE_SIZE = 16;
+	// Limits of a meshlet, a regular grid fills both at about the same time
+	constexpr size_t MESHLET_MAX_VERTICES = 64;
+	constexpr size_t MESHLET_MAX_TRIANGLES = 124;
+
+	// Average number of vertices transformed per triangle with a FIFO cache of the
+	// given size, between 0.5 for a perfect grid and 3 for no reuse at all
+	float compute_acmr(const unsigned int* indices, size_t num_indices, size_t num_vertices, size_t cache_size = VERTEX_CACHE_SIZE);
+
+	// Reorders the triangles for post-transform cache reuse with Tipsify (Sander,
+	// Nehab and Barczak, "Fast triangle reordering for vertex locality and reduced
+	// overdraw"), in time linear in the number of indices
+	void optimize_vertex_cache(unsigned int* indices, size_t num_indices, size_t num_vertices, size_t cache_size = VERTEX_CACHE_SIZE);
+
+	// Renumbers the vertices in the order the triangles first use them, so that
+	// the vertex fetches walk the streams forward
+	void optimize_vertex_fetch(
+			unsigned int* indices, size_t num_indices,
+			float3* positions, cg::vertex_attributes* attributes, size_t num_vertices);
+
+	// Splits the triangles into meshlets in their current order, a meshlet ends when
+	// the next triangle would exceed one of the limits. The order left by
+	// optimize_vertex_cache() is local, so the meshlets come out compact. The index
+	// offsets are relative to indices.
+	std::vector<cg::meshlet> build_meshlets(
+			const unsigned int* indices, size_t num_indices,
+			const float3* positions, size_t num_vertices,
+			size_t max_vertices = MESHLET_MAX_VERTICES, size_t max_triangles = MESHLET_MAX_TRIANGLES);
+}// namespace cg::world
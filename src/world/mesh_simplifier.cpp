@@ -0,0 +1,295 @@
+#include "mesh_simplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+
+
+namespace
+{
+	// Symmetric 4x4 matrix of the squared distances to a set of planes, weighted
+	// by the areas of their triangles
+	struct quadric
+	{
+		double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+		double a11 = 0, a12 = 0, a13 = 0;
+		double a22 = 0, a23 = 0;
+		double a33 = 0;
+		double weight = 0;
+
+		void add_plane(double a, double b, double c, double d, double w)
+		{
+			weight += w;
+			a *= std::sqrt(w);
+			b *= std::sqrt(w);
+			c *= std::sqrt(w);
+			d *= std::sqrt(w);
+			a00 += a * a;
+			a01 += a * b;
+			a02 += a * c;
+			a03 += a * d;
+			a11 += b * b;
+			a12 += b * c;
+			a13 += b * d;
+			a22 += c * c;
+			a23 += c * d;
+			a33 += d * d;
+		}
+
+		quadric& operator+=(const quadric& other)
+		{
+			a00 += other.a00;
+			a01 += other.a01;
+			a02 += other.a02;
+			a03 += other.a03;
+			a11 += other.a11;
+			a12 += other.a12;
+			a13 += other.a13;
+			a22 += other.a22;
+			a23 += other.a23;
+			a33 += other.a33;
+			weight += other.weight;
+			return *this;
+		}
+
+		// Mean squared distance to the planes
+		double evaluate(const float3& p) const
+		{
+			if (weight == 0)
+				return 0.0;
+			double x = p.x, y = p.y, z = p.z;
+			double result = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x +
+							a11 * y * y + 2 * a12 * y * z + 2 * a13 * y +
+							a22 * z * z + 2 * a23 * z +
+							a33;
+			return std::max(result / weight, 0.0);
+		}
+	};
+
+	struct collapse
+	{
+		unsigned int from;
+		unsigned int to;
+		double cost;
+	};
+
+	constexpr size_t MAX_PASSES = 32;
+}// namespace
+
+std::vector<unsigned int> cg::world::simplify_mesh(
+		const unsigned int* indices, size_t num_indices,
+		const float3* positions, size_t num_vertices,
+		size_t target_num_indices, float& error)
+{
+	std::vector<unsigned int> result(indices, indices + num_indices);
+	error = 0.f;
+	if (num_indices <= target_num_indices)
+		return result;
+
+	// Every vertex starts with the planes of the triangles around it
+	std::vector<quadric> quadrics(num_vertices);
+	std::vector<char> used(num_vertices, 0);
+	for (size_t i = 0; i + 2 < num_indices; i += 3)
+	{
+		const float3& a = positions[indices[i]];
+		const float3& b = positions[indices[i + 1]];
+		const float3& c = positions[indices[i + 2]];
+		float3 normal = cross(b - a, c - a);
+		float area = length(normal);
+		for (size_t k = 0; k < 3; k++)
+			used[indices[i + k]] = 1;
+		if (area == 0.f)
+			continue;
+		normal /= area;
+		quadric plane;
+		plane.add_plane(normal.x, normal.y, normal.z, -dot(normal, a), area * 0.5);
+		for (size_t k = 0; k < 3; k++)
+			quadrics[indices[i + k]] += plane;
+	}
+
+	// Vertices that share a position with another one sit on a normal or texture
+	// seam, moving them would tear the surface apart
+	std::vector<char> locked(num_vertices, 0);
+	std::vector<unsigned int> by_position;
+	for (size_t v = 0; v < num_vertices; v++)
+	{
+		if (used[v])
+			by_position.push_back(static_cast<unsigned int>(v));
+	}
+	auto position_less = [&](unsigned int l, unsigned int r) {
+		const float3& a = positions[l];
+		const float3& b = positions[r];
+		if (a.x != b.x)
+			return a.x < b.x;
+		if (a.y != b.y)
+			return a.y < b.y;
+		return a.z < b.z;
+	};
+	std::sort(by_position.begin(), by_position.end(), position_less);
+	for (size_t i = 1; i < by_position.size(); i++)
+	{
+		if (!position_less(by_position[i - 1], by_position[i]))
+		{
+			locked[by_position[i - 1]] = 1;
+			locked[by_position[i]] = 1;
+		}
+	}
+	std::vector<char> seam = locked;
+
+	std::vector<size_t> adjacency_offsets(num_vertices + 1);
+	std::vector<unsigned int> adjacency;
+	std::vector<uint64_t> edges;
+	std::vector<unsigned int> neighbours;
+	std::vector<collapse> best(num_vertices);
+	std::vector<collapse> candidates;
+	std::vector<char> touched(num_vertices);
+	std::vector<unsigned int> remap(num_vertices);
+
+	for (size_t pass = 0; pass < MAX_PASSES && result.size() > target_num_indices; pass++)
+	{
+		size_t num_triangles = result.size() / 3;
+
+		std::fill(adjacency_offsets.begin(), adjacency_offsets.end(), 0);
+		for (unsigned int vertex: result)
+			adjacency_offsets[vertex + 1]++;
+		std::partial_sum(adjacency_offsets.begin(), adjacency_offsets.end(), adjacency_offsets.begin());
+		adjacency.resize(result.size());
+		std::vector<size_t> fill(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+		for (size_t i = 0; i < result.size(); i++)
+			adjacency[fill[result[i]]++] = static_cast<unsigned int>(i / 3);
+
+		// Edges are found around their lower vertex. Edges used by a single triangle
+		// are on an open border, edges used by more than two are not manifold, both
+		// keep their vertices in place.
+		locked = seam;
+		edges.clear();
+		for (size_t v = 0; v < num_vertices; v++)
+		{
+			neighbours.clear();
+			for (size_t a = adjacency_offsets[v]; a < adjacency_offsets[v + 1]; a++)
+			{
+				const unsigned int* triangle = &result[3 * adjacency[a]];
+				for (size_t k = 0; k < 3; k++)
+				{
+					if (triangle[k] > v)
+						neighbours.push_back(triangle[k]);
+				}
+			}
+			std::sort(neighbours.begin(), neighbours.end());
+			for (size_t i = 0; i < neighbours.size();)
+			{
+				size_t j = i;
+				while (j < neighbours.size() && neighbours[j] == neighbours[i])
+					j++;
+				if (j - i != 2)
+				{
+					locked[v] = 1;
+					locked[neighbours[i]] = 1;
+				}
+				edges.push_back(static_cast<uint64_t>(v) << 32 | neighbours[i]);
+				i = j;
+			}
+		}
+
+		// A vertex moves at most once per pass, so only its cheapest collapse is a candidate
+		constexpr unsigned int none = ~0u;
+		std::fill(best.begin(), best.end(), collapse{none, none, 0.0});
+		auto consider = [&](unsigned int from, unsigned int to, double cost) {
+			if (!locked[from] && (best[from].to == none || cost < best[from].cost))
+				best[from] = collapse{from, to, cost};
+		};
+		for (uint64_t edge: edges)
+		{
+			auto a = static_cast<unsigned int>(edge >> 32);
+			auto b = static_cast<unsigned int>(edge & 0xffffffffu);
+			if (locked[a] && locked[b])
+				continue;
+			quadric sum = quadrics[a];
+			sum += quadrics[b];
+			consider(a, b, sum.evaluate(positions[b]));
+			consider(b, a, sum.evaluate(positions[a]));
+		}
+		candidates.clear();
+		for (const auto& candidate: best)
+		{
+			if (candidate.to != none)
+				candidates.push_back(candidate);
+		}
+		if (candidates.empty())
+			break;
+		std::sort(candidates.begin(), candidates.end(), [](const collapse& l, const collapse& r) {
+			return l.cost < r.cost;
+		});
+
+		// Collapses in one pass don't share triangles, so each one is checked
+		// against the mesh as it was at the start of the pass
+		std::fill(touched.begin(), touched.end(), 0);
+		std::iota(remap.begin(), remap.end(), 0u);
+		size_t removal_budget = num_triangles - target_num_indices / 3;
+		size_t removed = 0;
+		double max_cost = 0.0;
+		for (const auto& candidate: candidates)
+		{
+			if (removed >= removal_budget)
+				break;
+			unsigned int from = candidate.from;
+			unsigned int to = candidate.to;
+			if (touched[from] || touched[to])
+				continue;
+
+			// Moving the vertex must not turn any of its remaining triangles over
+			bool flips = false;
+			size_t collapsed = 0;
+			for (size_t a = adjacency_offsets[from]; a < adjacency_offsets[from + 1] && !flips; a++)
+			{
+				const unsigned int* triangle = &result[3 * adjacency[a]];
+				if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+				{
+					collapsed++;
+					continue;
+				}
+				float3 p[3], q[3];
+				for (size_t k = 0; k < 3; k++)
+				{
+					p[k] = positions[triangle[k]];
+					q[k] = triangle[k] == from ? positions[to] : p[k];
+				}
+				float3 before = cross(p[1] - p[0], p[2] - p[0]);
+				float3 after = cross(q[1] - q[0], q[2] - q[0]);
+				flips = dot(before, after) <= 0.f;
+			}
+			if (flips)
+				continue;
+
+			remap[from] = to;
+			quadrics[to] += quadrics[from];
+			for (size_t a = adjacency_offsets[from]; a < adjacency_offsets[from + 1]; a++)
+			{
+				const unsigned int* triangle = &result[3 * adjacency[a]];
+				for (size_t k = 0; k < 3; k++)
+					touched[triangle[k]] = 1;
+			}
+			removed += collapsed;
+			max_cost = std::max(max_cost, candidate.cost);
+		}
+		if (removed == 0)
+			break;
+		error = std::max(error, static_cast<float>(std::sqrt(max_cost)));
+
+		size_t write = 0;
+		for (size_t i = 0; i < result.size(); i += 3)
+		{
+			unsigned int a = remap[result[i]];
+			unsigned int b = remap[result[i + 1]];
+			unsigned int c = remap[result[i + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			result[write++] = a;
+			result[write++] = b;
+			result[write++] = c;
+		}
+		result.resize(write);
+	}
+	return result;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <linalg.h>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::world
+{
+	// Simplifies a triangle mesh towards the target number of indices by collapsing
+	// edges in the order of their quadric error (Garland and Heckbert, "Surface
+	// simplification using quadric error metrics"). Every collapse moves a vertex
+	// onto one of its neighbours, so the result indexes the same vertex streams.
+	// Vertices on open borders and on attribute seams stay in place to keep the
+	// surface closed. The error is the root mean square distance between the moved
+	// vertices and the original planes around them, in the units of the positions.
+	std::vector<unsigned int> simplify_mesh(
+			const unsigned int* indices, size_t num_indices,
+			const float3* positions, size_t num_vertices,
+			size_t target_num_indices, float& error);
+}// namespace cg::world
@@ -2,77 +2,440 @@
 
 #include "model.h"
 
+#include "mesh_optimizer.h"
+#include "mesh_simplifier.h"
+#include "obj_parser.h"
+#include "utils/mapped_file.h"
+#include "utils/mesh_compression.h"
+
 #include "utils/error_handler.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
 #include <linalg.h>
+#include <vector>
 
 
 using namespace linalg::aliases;
 using namespace cg::world;
 
-cg::world::model::model() {}
+namespace
+{
+	constexpr char CACHE_MAGIC[8] = {'C', 'G', 'M', 'E', 'S', 'H', 0, 0};
+	// Bumped whenever the layout of the cache or of the vertex streams changes
+	constexpr uint32_t CACHE_VERSION = 5;
 
-cg::world::model::~model() {}
+	// Processing the buffers of the cache went through
+	constexpr uint32_t CACHE_FLAG_OPTIMIZED = 1;
 
-void cg::world::model::load_obj(const std::filesystem::path& model_path)
-{
-	tinyobj::ObjReaderConfig readerConfig;
-	readerConfig.mtl_search_path = model_path.parent_path().string();
-	readerConfig.triangulate = true;
+	constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+	constexpr uint64_t FNV_PRIME = 0x100000001b3ull;
+
+	struct cache_string
+	{
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	struct cache_header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t attribute_size;
+		uint32_t flags;
+		uint32_t lod_levels;
+		uint64_t source_hash;
+		uint64_t file_size;
+		uint64_t num_shapes;
+		uint64_t num_libraries;
+		uint64_t num_materials;
+	};
+
+	struct cache_shape
+	{
+		uint64_t position_offset;
+		uint64_t attribute_offset;
+		uint64_t num_vertices;
+		uint64_t index_offset;
+		uint64_t num_indices;
+		uint64_t material_id;
+		cache_string texture;
+		shape_bounds bounds;
+		uint64_t meshlet_offset;
+		uint64_t num_meshlets;
+		uint64_t num_lods;
+		shape_lod lods[MAX_LOD_LEVELS];
+	};
 
-	tinyobj::ObjReader reader;
-	if (!reader.ParseFromFile(model_path.string(), readerConfig))
+	// Faces of an OBJ shape that use the same material, each one becomes a shape of the model
+	struct shape_part
 	{
-		if (!reader.Error().empty())
+		size_t shape;
+		int material_id;
+		size_t num_triangles;
+	};
+
+	uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+	{
+		const auto* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++)
 		{
-			THROW_ERROR(reader.Error());
+			hash ^= bytes[i];
+			hash *= FNV_PRIME;
 		}
+		return hash;
+	}
 
+	uint64_t align_offset(uint64_t offset)
+	{
+		return (offset + cg::CACHE_LINE_SIZE - 1) / cg::CACHE_LINE_SIZE * cg::CACHE_LINE_SIZE;
 	}
 
-	auto& shapes = reader.GetShapes();
-	auto& attrib = reader.GetAttrib();
-	auto& materials = reader.GetMaterials();
+	// Open addressing hash table from (vertex, normal, texcoord) index triples to
+	// the ids of the deduplicated vertices, sized once for the whole shape
+	class vertex_index_map
+	{
+	public:
+		explicit vertex_index_map(size_t max_entries)
+		{
+			size_t capacity = 16;
+			while (capacity < max_entries * 2)
+				capacity *= 2;
+			mask = capacity - 1;
+			slots.resize(capacity, slot{-1, -1, -1, 0});
+		}
+
+		// Returns the id stored for the triple and whether it has just been inserted
+		std::pair<unsigned int, bool> insert(const tinyobj::index_t& idx, unsigned int id)
+		{
+			size_t position = hash(idx) & mask;
+			while (true)
+			{
+				slot& current = slots[position];
+				if (current.vertex_index < 0)
+				{
+					current = slot{idx.vertex_index, idx.normal_index, idx.texcoord_index, id};
+					return {id, true};
+				}
+				if (current.vertex_index == idx.vertex_index &&
+					current.normal_index == idx.normal_index &&
+					current.texcoord_index == idx.texcoord_index)
+				{
+					return {current.id, false};
+				}
+				position = (position + 1) & mask;
+			}
+		}
+
+	protected:
+		struct slot
+		{
+			int vertex_index;
+			int normal_index;
+			int texcoord_index;
+			unsigned int id;
+		};
+		std::vector<slot> slots;
+		size_t mask;
+
+		static size_t hash(const tinyobj::index_t& idx)
+		{
+			// The triple packed into 64 bits, then mixed by the finalizer of MurmurHash3
+			uint64_t key = static_cast<uint64_t>(static_cast<uint32_t>(idx.vertex_index)) ^
+						   (static_cast<uint64_t>(static_cast<uint32_t>(idx.normal_index)) << 21) ^
+						   (static_cast<uint64_t>(static_cast<uint32_t>(idx.texcoord_index)) << 42);
+			key ^= key >> 33;
+			key *= 0xff51afd7ed558ccdull;
+			key ^= key >> 33;
+			key *= 0xc4ceb9fe1a85ec53ull;
+			key ^= key >> 33;
+			return static_cast<size_t>(key);
+		}
+	};
+}// namespace
+
+cg::world::model::model() {}
+
+cg::world::model::~model() {}
+
+void cg::world::model::load_obj(const std::filesystem::path& model_path, bool use_cache, bool optimize, size_t max_lod_levels)
+{
+	max_lod_levels = std::clamp(max_lod_levels, size_t{1}, MAX_LOD_LEVELS);
+	auto cache_path = std::filesystem::path(model_path).replace_extension(".cgmesh");
+	auto start = std::chrono::high_resolution_clock::now();
+	if (use_cache && load_cache(cache_path, model_path, optimize, max_lod_levels))
+	{
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+		std::cout << "Mapping " << cache_path.filename().string() << " took " << duration.count() << "ms\n";
+		return;
+	}
 
+	obj_data data = parse_obj(model_path, model_path.parent_path());
+	auto stop = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<float, std::milli> duration = stop - start;
+	std::cout << "Parsing " << model_path.filename().string() << " took " << duration.count() << "ms\n";
 
-	allocate_buffers(shapes);
+	fill_buffers(data.shapes, data.attrib, data.materials, model_path.parent_path(), optimize, max_lod_levels);
+	material_libraries = data.material_libraries;
 
-	fill_buffers(shapes, attrib, materials, model_path.parent_path());
+	if (use_cache)
+		save_cache(cache_path, model_path);
 }
 
-void model::allocate_buffers(const std::vector<tinyobj::shape_t>& shapes)
+bool model::load_cache(const std::filesystem::path& cache_path, const std::filesystem::path& model_path, bool optimize, size_t max_lod_levels)
 {
-	for (const auto& shape: shapes) 
+	std::error_code error;
+	if (!std::filesystem::exists(cache_path, error))
+		return false;
+
+	std::shared_ptr<cg::utils::mapped_file> file;
+	try
 	{
-		size_t index_offset = 0;
-		unsigned int vertex_buffer_size = 0;
-		unsigned int index_buffer_size = 0;
-		std::map<std::tuple<int, int, int>, unsigned int> index_map;
-		const auto& mesh = shape.mesh;
+		file = std::make_shared<cg::utils::mapped_file>(cache_path);
+	}
+	catch (const std::exception& exception)
+	{
+		std::cerr << error_message(exception) << "\n";
+		return false;
+	}
+
+	// Everything is validated before the first buffer is created, a stale or damaged cache is just rebuilt
+	char* data = file->data();
+	size_t size = file->size();
+	if (size < sizeof(cache_header))
+		return false;
+	const auto& header = *reinterpret_cast<const cache_header*>(data);
+	if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+		header.version != CACHE_VERSION || header.attribute_size != sizeof(cg::vertex_attributes) ||
+		header.flags != (optimize ? CACHE_FLAG_OPTIMIZED : 0u) ||
+		header.lod_levels != max_lod_levels ||
+		header.file_size != size)
+		return false;
+
+	// Counts are bounded by the file before they are multiplied, so no product overflows
+	auto fits = [&](uint64_t count, size_t element_size) {
+		return count <= size / element_size;
+	};
+	if (!fits(header.num_shapes, sizeof(cache_shape)) || !fits(header.num_libraries, sizeof(cache_string)) ||
+		!fits(header.num_materials, sizeof(cg::material)))
+		return false;
+	size_t tables_end = sizeof(cache_header) + header.num_shapes * sizeof(cache_shape) +
+						header.num_libraries * sizeof(cache_string) + header.num_materials * sizeof(cg::material);
+	if (tables_end > size)
+		return false;
+	const auto* shapes = reinterpret_cast<const cache_shape*>(data + sizeof(cache_header));
+	const auto* library_names = reinterpret_cast<const cache_string*>(shapes + header.num_shapes);
+	const auto* cached_materials = reinterpret_cast<const cg::material*>(library_names + header.num_libraries);
+
+	auto in_file = [&](uint64_t offset, uint64_t bytes) {
+		return offset <= size && bytes <= size - offset;
+	};
+	auto array_in_file = [&](uint64_t offset, uint64_t count, size_t element_size) {
+		return fits(count, element_size) && in_file(offset, count * element_size);
+	};
+	auto read_string = [&](const cache_string& string) {
+		return std::string(data + string.offset, string.length);
+	};
 
-		for (const auto& fv: mesh.num_face_vertices) 
+	std::vector<std::filesystem::path> libraries;
+	for (size_t i = 0; i < header.num_libraries; i++)
+	{
+		if (!in_file(library_names[i].offset, library_names[i].length))
+			return false;
+		libraries.push_back(model_path.parent_path() / read_string(library_names[i]));
+	}
+	if (header.source_hash != source_hash(model_path, libraries))
+		return false;
+
+	for (size_t s = 0; s < header.num_shapes; s++)
+	{
+		const auto& shape = shapes[s];
+		if (!array_in_file(shape.position_offset, shape.num_vertices, sizeof(float3)) ||
+			!array_in_file(shape.attribute_offset, shape.num_vertices, sizeof(cg::vertex_attributes)) ||
+			!array_in_file(shape.index_offset, shape.num_indices, sizeof(unsigned int)) ||
+			!in_file(shape.texture.offset, shape.texture.length) ||
+			shape.material_id >= header.num_materials ||
+			shape.position_offset % alignof(float3) != 0 ||
+			shape.attribute_offset % alignof(cg::vertex_attributes) != 0 ||
+			!array_in_file(shape.meshlet_offset, shape.num_meshlets, sizeof(cg::meshlet)) ||
+			shape.index_offset % alignof(unsigned int) != 0 ||
+			shape.meshlet_offset % alignof(cg::meshlet) != 0 ||
+			shape.num_lods == 0 || shape.num_lods > MAX_LOD_LEVELS)
+			return false;
+		for (size_t l = 0; l < shape.num_lods; l++)
 		{
-			for (size_t v = 0; v < fv; v++) 
-			{
-				tinyobj::index_t idx = mesh.indices[index_offset + v];
-				auto idx_tuple = std::make_tuple(idx.vertex_index, idx.normal_index, idx.texcoord_index);
-				if (index_map.count(idx_tuple) == 0) 
-				{
-					index_map[idx_tuple] = vertex_buffer_size;
-					vertex_buffer_size++;
-				}
-				index_buffer_size++;
-			}
-			index_offset += fv;
+			const auto& lod = shape.lods[l];
+			if (lod.index_offset > shape.num_indices || lod.index_count > shape.num_indices - lod.index_offset ||
+				lod.meshlet_offset > shape.num_meshlets || lod.meshlet_count > shape.num_meshlets - lod.meshlet_offset)
+				return false;
+		}
+		const auto* meshlets = reinterpret_cast<const cg::meshlet*>(data + shape.meshlet_offset);
+		for (size_t m = 0; m < shape.num_meshlets; m++)
+		{
+			if (meshlets[m].index_offset > shape.num_indices ||
+				meshlets[m].index_count > shape.num_indices - meshlets[m].index_offset)
+				return false;
+		}
+		// The renderers index the vertex buffers without checks
+		const auto* indices = reinterpret_cast<const unsigned int*>(data + shape.index_offset);
+		for (size_t i = 0; i < shape.num_indices; i++)
+		{
+			if (indices[i] >= shape.num_vertices)
+				return false;
 		}
-		vertex_buffers.push_back(
-			std::make_shared<cg::resource<cg::vertex>>(vertex_buffer_size)
-		);
-		index_buffers.push_back(
-			std::make_shared<cg::resource<unsigned int>>(index_buffer_size)
-		);
 	}
-	textures.resize(shapes.size());
+
+	// The buffers point straight into the mapping and keep it alive
+	for (size_t s = 0; s < header.num_shapes; s++)
+	{
+		const auto& shape = shapes[s];
+		position_buffers.push_back(std::make_shared<cg::resource<float3>>(
+				reinterpret_cast<float3*>(data + shape.position_offset), shape.num_vertices, file));
+		attribute_buffers.push_back(std::make_shared<cg::resource<cg::vertex_attributes>>(
+				reinterpret_cast<cg::vertex_attributes*>(data + shape.attribute_offset), shape.num_vertices, file));
+		index_buffers.push_back(std::make_shared<cg::resource<unsigned int>>(
+				reinterpret_cast<unsigned int*>(data + shape.index_offset), shape.num_indices, file));
+		meshlet_buffers.push_back(std::make_shared<cg::resource<cg::meshlet>>(
+				reinterpret_cast<cg::meshlet*>(data + shape.meshlet_offset), shape.num_meshlets, file));
+		material_ids.push_back(static_cast<unsigned int>(shape.material_id));
+		std::string texture = read_string(shape.texture);
+		textures.push_back(texture.empty() ? std::filesystem::path{} : model_path.parent_path() / texture);
+		bounds.push_back(shape.bounds);
+		lods.emplace_back(shape.lods, shape.lods + shape.num_lods);
+	}
+	materials.assign(cached_materials, cached_materials + header.num_materials);
+	material_libraries = libraries;
+	optimized = optimize;
+	lod_levels = max_lod_levels;
+	return true;
+}
+
+void model::save_cache(const std::filesystem::path& cache_path, const std::filesystem::path& model_path) const
+{
+	auto base_folder = model_path.parent_path();
+	std::vector<std::string> library_names;
+	for (const auto& library: material_libraries)
+		library_names.push_back(library.lexically_relative(base_folder).generic_string());
+	std::vector<std::string> texture_names;
+	for (const auto& texture: textures)
+		texture_names.push_back(texture.empty() ? std::string{} : texture.lexically_relative(base_folder).generic_string());
+
+	// Header, shape, library and material tables, strings, then the cache line aligned buffers
+	cache_header header{};
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.attribute_size = sizeof(cg::vertex_attributes);
+	header.flags = optimized ? CACHE_FLAG_OPTIMIZED : 0u;
+	header.lod_levels = static_cast<uint32_t>(lod_levels);
+	header.source_hash = source_hash(model_path, material_libraries);
+	header.num_shapes = position_buffers.size();
+	header.num_libraries = library_names.size();
+	header.num_materials = materials.size();
+
+	uint64_t offset = sizeof(cache_header) + header.num_shapes * sizeof(cache_shape) +
+					  header.num_libraries * sizeof(cache_string) + header.num_materials * sizeof(cg::material);
+	std::vector<cache_string> library_table;
+	for (const auto& name: library_names)
+	{
+		library_table.push_back(cache_string{offset, name.size()});
+		offset += name.size();
+	}
+	std::vector<cache_shape> shape_table(header.num_shapes);
+	for (size_t s = 0; s < header.num_shapes; s++)
+	{
+		shape_table[s].texture = cache_string{offset, texture_names[s].size()};
+		offset += texture_names[s].size();
+	}
+	for (size_t s = 0; s < header.num_shapes; s++)
+	{
+		shape_table[s].num_vertices = position_buffers[s]->count();
+		shape_table[s].position_offset = offset = align_offset(offset);
+		offset += position_buffers[s]->size_bytes();
+		shape_table[s].attribute_offset = offset = align_offset(offset);
+		offset += attribute_buffers[s]->size_bytes();
+		shape_table[s].index_offset = offset = align_offset(offset);
+		shape_table[s].num_indices = index_buffers[s]->count();
+		offset += index_buffers[s]->size_bytes();
+		shape_table[s].meshlet_offset = offset = align_offset(offset);
+		shape_table[s].num_meshlets = meshlet_buffers[s]->count();
+		offset += meshlet_buffers[s]->size_bytes();
+		shape_table[s].material_id = material_ids[s];
+		shape_table[s].bounds = bounds[s];
+		shape_table[s].num_lods = lods[s].size();
+		std::copy(lods[s].begin(), lods[s].end(), shape_table[s].lods);
+	}
+	header.file_size = offset;
+
+	// Written aside and renamed, so a crash never leaves a truncated cache behind
+	auto temporary_path = std::filesystem::path(cache_path).concat(".tmp");
+	{
+		std::ofstream file(temporary_path, std::ios::binary);
+		if (!file)
+		{
+			std::cout << "Can't write the mesh cache " << cache_path.string() << "\n";
+			return;
+		}
+		auto write = [&](const void* bytes, size_t size) {
+			file.write(static_cast<const char*>(bytes), static_cast<std::streamsize>(size));
+		};
+		auto pad_to = [&](uint64_t target) {
+			static const char zeros[cg::CACHE_LINE_SIZE] = {};
+			write(zeros, target - static_cast<uint64_t>(file.tellp()));
+		};
+		write(&header, sizeof(header));
+		write(shape_table.data(), shape_table.size() * sizeof(cache_shape));
+		write(library_table.data(), library_table.size() * sizeof(cache_string));
+		write(materials.data(), materials.size() * sizeof(cg::material));
+		for (const auto& name: library_names)
+			write(name.data(), name.size());
+		for (const auto& name: texture_names)
+			write(name.data(), name.size());
+		for (size_t s = 0; s < header.num_shapes; s++)
+		{
+			pad_to(shape_table[s].position_offset);
+			write(position_buffers[s]->data(), position_buffers[s]->size_bytes());
+			pad_to(shape_table[s].attribute_offset);
+			write(attribute_buffers[s]->data(), attribute_buffers[s]->size_bytes());
+			pad_to(shape_table[s].index_offset);
+			write(index_buffers[s]->data(), index_buffers[s]->size_bytes());
+			pad_to(shape_table[s].meshlet_offset);
+			write(meshlet_buffers[s]->data(), meshlet_buffers[s]->size_bytes());
+		}
+		if (!file)
+		{
+			std::cout << "Can't write the mesh cache " << cache_path.string() << "\n";
+			return;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(temporary_path, cache_path, error);
+	if (error)
+		std::cout << "Can't write the mesh cache " << cache_path.string() << ": " << error.message() << "\n";
+}
+
+uint64_t model::source_hash(const std::filesystem::path& model_path, const std::vector<std::filesystem::path>& libraries)
+{
+	// The sources are identified by their sizes and write times, reading them would defeat the cache
+	uint64_t hash = FNV_OFFSET_BASIS;
+	auto add_file = [&](const std::filesystem::path& path) {
+		std::error_code error;
+		int64_t stamp[2] = {
+				static_cast<int64_t>(std::filesystem::file_size(path, error)),
+				static_cast<int64_t>(std::filesystem::last_write_time(path, error).time_since_epoch().count())};
+		hash = fnv1a(hash, stamp, sizeof(stamp));
+		std::string name = path.filename().string();
+		hash = fnv1a(hash, name.data(), name.size());
+	};
+	add_file(model_path);
+	for (const auto& library: libraries)
+		add_file(library);
+	return hash;
 }
 
 float3 cg::world::model::compute_normal(const tinyobj::attrib_t& attrib, const tinyobj::mesh_t& mesh, size_t index_offset)
@@ -102,9 +465,9 @@ float3 cg::world::model::compute_normal(const tinyobj::attrib_t& attrib, const t
 	return normalize(cross(b - a, c - a));
 }
 
-void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, const tinyobj::index_t idx, const float3 computed_normal, const tinyobj::material_t material)
+void model::fill_vertex_data(float3& position, cg::vertex_attributes& attributes, const tinyobj::attrib_t& attrib, const tinyobj::index_t idx, const float3 computed_normal)
 {
-	vertex.position = float3{
+	position = float3{
 			attrib.vertices[3 * idx.vertex_index],
 			attrib.vertices[3 * idx.vertex_index + 1],
 			attrib.vertices[3 * idx.vertex_index + 2]
@@ -112,11 +475,11 @@ void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib
 
 	if (idx.normal_index < 0)
 	{
-		vertex.normal = computed_normal;
+		attributes.normal = computed_normal;
 	}
 	else
 	{
-		vertex.normal = float3{
+		attributes.normal = float3{
 				attrib.normals[3 * idx.normal_index],
 				attrib.normals[3 * idx.normal_index + 1],
 				attrib.normals[3 * idx.normal_index + 2]
@@ -125,92 +488,349 @@ void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib
 
 	if (idx.texcoord_index < 0)
 	{
-		vertex.texture = float2{0, 0};
+		attributes.texture = float2{0, 0};
 	}
 	else
 	{
-		vertex.texture = float2{
+		attributes.texture = float2{
 				attrib.texcoords[2 * idx.texcoord_index],
 				attrib.texcoords[2 * idx.texcoord_index + 1]
 		};
 	}
-
-	vertex.ambient = float3{
-			material.ambient[0],
-			material.ambient[1],
-			material.ambient[2]
-	};
-
-	vertex.diffuse = float3{
-			material.diffuse[0],
-			material.diffuse[1],
-			material.diffuse[2]
-	};
-
-	vertex.emissive = float3{
-			material.emission[0],
-			material.emission[1],
-			material.emission[2]
-	};
 }
 
-void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& materials, const std::filesystem::path& base_folder)
+void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& obj_materials, const std::filesystem::path& base_folder, bool optimize, size_t max_lod_levels)
 {
+	materials.clear();
+	for (const auto& material: obj_materials)
+	{
+		materials.push_back(cg::material{
+				float3{material.ambient[0], material.ambient[1], material.ambient[2]},
+				float3{material.diffuse[0], material.diffuse[1], material.diffuse[2]},
+				float3{material.emission[0], material.emission[1], material.emission[2]}});
+	}
+
+	// Shapes mixing materials are split, so that the material becomes a per-shape constant
+	std::vector<shape_part> parts;
 	for (size_t s=0; s<shapes.size(); s++)
 	{
-		size_t index_offset = 0;
-		unsigned int vertex_buffer_id = 0;
-		unsigned int index_buffer_id = 0;
-		auto vertex_buffer = vertex_buffers[s];
-		auto index_buffer = index_buffers[s];
+		size_t first_part = parts.size();
+		for (int material_id : shapes[s].mesh.material_ids)
+		{
+			auto part = std::find_if(parts.begin() + first_part, parts.end(), [&](const shape_part& part) {
+				return part.material_id == material_id;
+			});
+			if (part == parts.end())
+			{
+				parts.push_back(shape_part{s, material_id, 0});
+				part = parts.end() - 1;
+			}
+			part->num_triangles++;
+		}
+	}
 
-		std::map<std::tuple<int, int, int>, unsigned int> index_map;
-		const auto& mesh = shapes[s].mesh;
+	// Faces without a material get a black one
+	unsigned int default_material_id = static_cast<unsigned int>(materials.size());
+	for (const auto& part: parts)
+	{
+		if (part.material_id < 0)
+		{
+			materials.push_back(cg::material{});
+			break;
+		}
+	}
+
+	position_buffers.resize(parts.size());
+	attribute_buffers.resize(parts.size());
+	index_buffers.resize(parts.size());
+	material_ids.resize(parts.size());
+	textures.resize(parts.size());
+	bounds.resize(parts.size());
+	lods.resize(parts.size());
+	meshlet_buffers.resize(parts.size());
+	std::vector<float> load_times(parts.size());
+	// Vertices transformed with a simulated post-transform cache, before and after the optimization
+	std::vector<float> transforms_before(parts.size());
+	std::vector<float> transforms_after(parts.size());
+
+	// Parts are independent, each one is built by its own thread into its preallocated slots
+#pragma omp parallel for schedule(dynamic)
+	for (int p=0; p<static_cast<int>(parts.size()); p++)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+
+		const auto& part = parts[p];
+		const auto& mesh = shapes[part.shape].mesh;
+
+		// Faces are triangulated, so every part has exactly three indices per
+		// triangle and at most as many unique vertices
+		size_t num_indices = 3 * part.num_triangles;
+		auto index_buffer = std::make_shared<cg::resource<unsigned int>>(num_indices);
+		unsigned int* indices = index_buffer->data();
+		std::vector<float3> positions;
+		std::vector<cg::vertex_attributes> attributes;
+		positions.reserve(3 * part.num_triangles);
+		attributes.reserve(3 * part.num_triangles);
+		vertex_index_map index_map(3 * part.num_triangles);
 
+		size_t index_offset = 0;
+		size_t output_offset = 0;
 		for (size_t f=0; f<mesh.num_face_vertices.size(); f++)
 		{
 			int fv = mesh.num_face_vertices[f];
+			if (mesh.material_ids[f] != part.material_id)
+			{
+				index_offset += fv;
+				continue;
+			}
+
 			float3 normal;
 			if (mesh.indices[index_offset].normal_index < 0)
 			{
 				normal = compute_normal(attrib, mesh, index_offset);
 			}
-			
 
 			for (size_t v=0; v<fv; v++)
 			{
 				tinyobj::index_t idx = mesh.indices[index_offset + v];
-				auto idx_tuple = std::make_tuple(idx.vertex_index, idx.normal_index, idx.texcoord_index);
-				if (index_map.count(idx_tuple) == 0)
+				auto vertex_id = static_cast<unsigned int>(positions.size());
+				auto [id, inserted] = index_map.insert(idx, vertex_id);
+				if (inserted)
 				{
-					cg:vertex& vertex = vertex_buffer->item(vertex_buffer_id);
+					fill_vertex_data(positions.emplace_back(), attributes.emplace_back(), attrib, idx, normal);
+				}
+				indices[output_offset++] = id;
+			}
+			index_offset += fv;
+		}
 
-					const auto& material = materials[mesh.material_ids[f]];
+		if (optimize)
+		{
+			transforms_before[p] = compute_acmr(indices, num_indices, positions.size()) * part.num_triangles;
+			optimize_vertex_cache(indices, num_indices, positions.size());
+			optimize_vertex_fetch(indices, num_indices, positions.data(), attributes.data(), positions.size());
+			transforms_after[p] = compute_acmr(indices, num_indices, positions.size()) * part.num_triangles;
+		}
 
-					fill_vertex_data(vertex, attrib, idx, normal, material);
+		// Every coarser level aims at half the triangles of the previous one, the
+		// chain ends early when the simplification stalls on seams and borders
+		std::vector<shape_lod> shape_lods{shape_lod{0, static_cast<uint32_t>(num_indices), 0.f, 0, 0}};
+		std::vector<unsigned int> lod_indices;
+		while (shape_lods.size() < max_lod_levels)
+		{
+			shape_lod previous = shape_lods.back();
+			const unsigned int* previous_indices = previous.index_offset == 0 ? indices : lod_indices.data() + (previous.index_offset - num_indices);
+			float error;
+			auto simplified = simplify_mesh(
+					previous_indices, previous.index_count, positions.data(), positions.size(),
+					previous.index_count / 6 * 3, error);
+			if (simplified.empty() || simplified.size() * 10 > previous.index_count * 9)
+				break;
+			if (optimize)
+				optimize_vertex_cache(simplified.data(), simplified.size(), positions.size());
+			shape_lods.push_back(shape_lod{
+					static_cast<uint32_t>(num_indices + lod_indices.size()),
+					static_cast<uint32_t>(simplified.size()),
+					previous.error + error, 0, 0});
+			lod_indices.insert(lod_indices.end(), simplified.begin(), simplified.end());
+		}
+		if (!lod_indices.empty())
+		{
+			auto full_index_buffer = std::make_shared<cg::resource<unsigned int>>(num_indices + lod_indices.size());
+			std::copy(indices, indices + num_indices, full_index_buffer->data());
+			std::copy(lod_indices.begin(), lod_indices.end(), full_index_buffer->data() + num_indices);
+			index_buffer = full_index_buffer;
+		}
 
-					index_map[idx_tuple] = vertex_buffer_id;
-					vertex_buffer_id++;
-				}
-				index_buffer->item(index_buffer_id) = index_map[idx_tuple];
-				index_buffer_id++;
-				
+		// Every level is split into its own meshlets
+		std::vector<cg::meshlet> meshlets;
+		for (auto& lod: shape_lods)
+		{
+			auto lod_meshlets = build_meshlets(
+					index_buffer->data() + lod.index_offset, lod.index_count, positions.data(), positions.size());
+			for (auto& meshlet: lod_meshlets)
+				meshlet.index_offset += lod.index_offset;
+			lod.meshlet_offset = static_cast<uint32_t>(meshlets.size());
+			lod.meshlet_count = static_cast<uint32_t>(lod_meshlets.size());
+			meshlets.insert(meshlets.end(), lod_meshlets.begin(), lod_meshlets.end());
+		}
+		auto meshlet_buffer = std::make_shared<cg::resource<cg::meshlet>>(meshlets.size());
+		std::copy(meshlets.begin(), meshlets.end(), meshlet_buffer->data());
+		meshlet_buffers[p] = meshlet_buffer;
+		lods[p] = shape_lods;
+
+		// Vertex buffers of big scenes span many pages, let them use huge pages
+		cg::resource_allocation vertex_allocation;
+		vertex_allocation.huge_pages = true;
+		auto position_buffer = std::make_shared<cg::resource<float3>>(positions.size(), vertex_allocation);
+		std::copy(positions.begin(), positions.end(), position_buffer->data());
+		auto attribute_buffer = std::make_shared<cg::resource<cg::vertex_attributes>>(attributes.size(), vertex_allocation);
+		std::copy(attributes.begin(), attributes.end(), attribute_buffer->data());
+
+		position_buffers[p] = position_buffer;
+		attribute_buffers[p] = attribute_buffer;
+		index_buffers[p] = index_buffer;
+
+		if (part.material_id < 0)
+		{
+			material_ids[p] = default_material_id;
+		}
+		else
+		{
+			material_ids[p] = static_cast<unsigned int>(part.material_id);
+			if (!obj_materials[part.material_id].diffuse_texname.empty())
+			{
+				textures[p] = base_folder / obj_materials[part.material_id].diffuse_texname;
 			}
-			index_offset += fv;
 		}
-		if (!materials[mesh.material_ids[0]].diffuse_texname.empty())
+		bounds[p] = compute_bounds(*position_buffer);
+
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+		load_times[p] = duration.count();
+	}
+
+	for (size_t p=0; p<parts.size(); p++)
+	{
+		std::cout << "Shape " << shapes[parts[p].shape].name << ": " << position_buffers[p]->count() << " vertices, "
+				  << lods[p][0].index_count << " indices, " << lods[p][0].meshlet_count << " meshlets, material " << material_ids[p]
+				  << ", built in " << load_times[p] << "ms\n";
+	}
+
+	lod_levels = max_lod_levels;
+	if (max_lod_levels > 1)
+	{
+		std::vector<size_t> triangles_per_level(max_lod_levels, 0);
+		for (const auto& shape_lods: lods)
+		{
+			// Shapes with a shorter chain draw their coarsest level instead
+			for (size_t l = 0; l < max_lod_levels; l++)
+				triangles_per_level[l] += shape_lods[std::min(l, shape_lods.size() - 1)].index_count / 3;
+		}
+		std::cout << "Levels of detail:";
+		for (size_t l = 0; l < max_lod_levels; l++)
+			std::cout << (l ? " -> " : " ") << triangles_per_level[l];
+		std::cout << " triangles\n";
+	}
+
+	optimized = optimize;
+	if (optimize)
+	{
+		float total_before = 0.f;
+		float total_after = 0.f;
+		size_t total_triangles = 0;
+		for (size_t p=0; p<parts.size(); p++)
+		{
+			total_before += transforms_before[p];
+			total_after += transforms_after[p];
+			total_triangles += parts[p].num_triangles;
+		}
+		if (total_triangles > 0)
 		{
-			textures[s] = base_folder / materials[mesh.material_ids[0]].diffuse_texname;
+			std::cout << "Vertex cache optimization: ACMR " << total_before / total_triangles << " -> "
+					  << total_after / total_triangles << " with " << VERTEX_CACHE_SIZE << " cached vertices\n";
 		}
 	}
-		
 }
 
 
-const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>&
-cg::world::model::get_vertex_buffers() const
+shape_bounds model::compute_bounds(cg::resource<float3>& position_buffer)
 {
-	return vertex_buffers;
+	shape_bounds result{};
+	if (position_buffer.count() == 0)
+		return result;
+
+	const auto positions = position_buffer.view();
+	result.aabb_min = result.aabb_max = positions[0];
+	for (const auto& position : positions)
+	{
+		result.aabb_min = min(result.aabb_min, position);
+		result.aabb_max = max(result.aabb_max, position);
+	}
+
+	// The sphere is centered at the box, its radius is fitted to the vertices
+	result.sphere_center = (result.aabb_min + result.aabb_max) * 0.5f;
+	for (const auto& position : positions)
+	{
+		result.sphere_radius = std::max(
+				result.sphere_radius,
+				length(position - result.sphere_center));
+	}
+	return result;
+}
+
+void model::compress()
+{
+	if (is_compressed())
+		return;
+
+	size_t num_shapes = index_buffers.size();
+	quantized_position_buffers.resize(num_shapes);
+	packed_attribute_buffers.resize(num_shapes);
+	short_index_buffers.resize(num_shapes);
+	size_t bytes_before = 0;
+	size_t bytes_after = 0;
+
+#pragma omp parallel for schedule(dynamic) reduction(+ : bytes_before, bytes_after)
+	for (int s = 0; s < static_cast<int>(num_shapes); s++)
+	{
+		const auto positions = position_buffers[s]->view();
+		const auto attributes = attribute_buffers[s]->view();
+		const auto& shape = bounds[s];
+
+		cg::resource_allocation vertex_allocation;
+		vertex_allocation.huge_pages = true;
+		auto quantized_positions = std::make_shared<cg::resource<cg::quantized_position>>(positions.size, vertex_allocation);
+		auto packed_attributes = std::make_shared<cg::resource<cg::packed_vertex_attributes>>(attributes.size, vertex_allocation);
+		cg::quantized_position* quantized = quantized_positions->data();
+		cg::packed_vertex_attributes* packed = packed_attributes->data();
+		for (size_t v = 0; v < positions.size; v++)
+		{
+			quantized[v] = cg::utils::quantize_position(positions[v], shape.aabb_min, shape.aabb_max);
+			packed[v] = cg::utils::pack_vertex_attributes(attributes[v]);
+		}
+		bytes_before += position_buffers[s]->size_bytes() + attribute_buffers[s]->size_bytes() + index_buffers[s]->size_bytes();
+		bytes_after += quantized_positions->size_bytes() + packed_attributes->size_bytes();
+
+		// Vertex ids fit into 16 bits when there are at most 65536 vertices
+		if (positions.size <= std::numeric_limits<uint16_t>::max() + size_t{1})
+		{
+			const auto indices = index_buffers[s]->view();
+			auto short_indices = std::make_shared<cg::resource<uint16_t>>(indices.size);
+			std::copy(indices.begin(), indices.end(), short_indices->data());
+			bytes_after += short_indices->size_bytes();
+			short_index_buffers[s] = short_indices;
+			index_buffers[s] = nullptr;
+		}
+		else
+		{
+			bytes_after += index_buffers[s]->size_bytes();
+		}
+
+		quantized_position_buffers[s] = quantized_positions;
+		packed_attribute_buffers[s] = packed_attributes;
+	}
+
+	position_buffers.clear();
+	attribute_buffers.clear();
+	std::cout << "Compressed the mesh from " << bytes_before << " to " << bytes_after << " bytes\n";
+}
+
+bool model::is_compressed() const
+{
+	return !quantized_position_buffers.empty();
+}
+
+const std::vector<std::shared_ptr<cg::resource<float3>>>&
+cg::world::model::get_position_buffers() const
+{
+	return position_buffers;
+}
+
+const std::vector<std::shared_ptr<cg::resource<cg::vertex_attributes>>>&
+cg::world::model::get_attribute_buffers() const
+{
+	return attribute_buffers;
 }
 
 const std::vector<std::shared_ptr<cg::resource<unsigned int>>>&
@@ -219,12 +839,94 @@ cg::world::model::get_index_buffers() const
 	return index_buffers;
 }
 
+const std::vector<cg::material>& cg::world::model::get_materials() const
+{
+	return materials;
+}
+
+const std::vector<unsigned int>& cg::world::model::get_per_shape_material_ids() const
+{
+	return material_ids;
+}
+
 const std::vector<std::filesystem::path>& cg::world::model::get_per_shape_texture_files() const
 {
 	return textures;
 }
 
 
+const std::vector<shape_bounds>& cg::world::model::get_per_shape_bounds() const
+{
+	return bounds;
+}
+
+const std::vector<std::shared_ptr<cg::resource<cg::quantized_position>>>&
+cg::world::model::get_quantized_position_buffers() const
+{
+	return quantized_position_buffers;
+}
+
+const std::vector<std::shared_ptr<cg::resource<cg::packed_vertex_attributes>>>&
+cg::world::model::get_packed_attribute_buffers() const
+{
+	return packed_attribute_buffers;
+}
+
+const std::vector<std::shared_ptr<cg::resource<uint16_t>>>&
+cg::world::model::get_short_index_buffers() const
+{
+	return short_index_buffers;
+}
+
+size_t cg::world::model::get_index_count(size_t shape_id) const
+{
+	return lods[shape_id][0].index_count;
+}
+
+const std::vector<std::vector<shape_lod>>& cg::world::model::get_per_shape_lods() const
+{
+	return lods;
+}
+
+const std::vector<std::shared_ptr<cg::resource<cg::meshlet>>>& cg::world::model::get_meshlet_buffers() const
+{
+	return meshlet_buffers;
+}
+
+const shape_lod& cg::world::model::select_lod(size_t shape_id, const camera& camera, float max_error_pixels) const
+{
+	float4x4 identity{
+			{1, 0, 0, 0},
+			{0, 1, 0, 0},
+			{0, 0, 1, 0},
+			{0, 0, 0, 1}};
+	return select_lod(shape_id, camera, max_error_pixels, identity);
+}
+
+const shape_lod& cg::world::model::select_lod(
+		size_t shape_id, const camera& camera, float max_error_pixels, const float4x4& instance_transform) const
+{
+	const auto& shape_lods = lods[shape_id];
+	const auto& shape = bounds[shape_id];
+
+	// Distances and errors grow with the largest scale of the instance
+	float scale = std::max(
+			length(instance_transform[0].xyz()),
+			std::max(length(instance_transform[1].xyz()), length(instance_transform[2].xyz())));
+
+	// The error is projected from the closest point of the bounding sphere
+	float4x4 world_matrix = mul(get_world_matrix(), instance_transform);
+	float3 center = mul(world_matrix, float4{shape.sphere_center, 1.f}).xyz();
+	float distance = length(center - camera.get_position()) - shape.sphere_radius * scale;
+	size_t level = 0;
+	while (level + 1 < shape_lods.size() &&
+		   camera.get_projected_size(shape_lods[level + 1].error * scale, distance) <= max_error_pixels)
+	{
+		level++;
+	}
+	return shape_lods[level];
+}
+
 const float4x4 cg::world::model::get_world_matrix() const
 {
 	return float4x4{
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "camera.h"
 #include "resource.h"
 
+#include <cstdint>
 #include <filesystem>
 #include <linalg.h>
 #include <tiny_obj_loader.h>
@@ -11,29 +13,97 @@ using namespace linalg::aliases;
 
 namespace cg::world
 {
+	// Object space bounding volumes of a shape, computed at load time
+	struct shape_bounds
+	{
+		float3 aabb_min;
+		float3 aabb_max;
+		float3 sphere_center;
+		float sphere_radius;
+	};
+
+	constexpr size_t MAX_LOD_LEVELS = 4;
+
+	// Part of the index buffer of a shape that holds one level of detail. All the
+	// levels index the same vertex streams, the error is how far the surface moved
+	// from the full resolution mesh, in object space units. The meshlets of the
+	// level are a range of the meshlet buffer of the shape.
+	struct shape_lod
+	{
+		uint32_t index_offset;
+		uint32_t index_count;
+		float error;
+		uint32_t meshlet_offset;
+		uint32_t meshlet_count;
+	};
+
 	class model
 	{
 	public:
 		model();
 		virtual ~model();
 
-		void load_obj(const std::filesystem::path& model_path);
+		// With use_cache, reuses the binary cache next to the OBJ file when it's up to date and writes it otherwise.
+		// Optimization reorders the triangles and vertices of every shape for cache locality.
+		// Every shape gets up to lod_levels levels of detail, the first one is the full mesh.
+		void load_obj(const std::filesystem::path& model_path, bool use_cache = false, bool optimize = true, size_t lod_levels = 1);
 
-		const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& get_vertex_buffers() const;
+		// Every shape has a single material, the positions and the shading attributes are separate streams
+		const std::vector<std::shared_ptr<cg::resource<float3>>>& get_position_buffers() const;
+		const std::vector<std::shared_ptr<cg::resource<cg::vertex_attributes>>>& get_attribute_buffers() const;
 		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_index_buffers() const;
+		const std::vector<cg::material>& get_materials() const;
+		const std::vector<unsigned int>& get_per_shape_material_ids() const;
 		const std::vector<std::filesystem::path>& get_per_shape_texture_files() const;
+		const std::vector<shape_bounds>& get_per_shape_bounds() const;
+
+		// Replaces the streams with their compressed forms: positions quantized against
+		// the shape bounds, octahedral normals, half texture coordinates and 16-bit
+		// indices for the shapes they fit. The full precision getters are empty then.
+		void compress();
+		bool is_compressed() const;
+		const std::vector<std::shared_ptr<cg::resource<cg::quantized_position>>>& get_quantized_position_buffers() const;
+		const std::vector<std::shared_ptr<cg::resource<cg::packed_vertex_attributes>>>& get_packed_attribute_buffers() const;
+		// Null for the shapes that keep 32-bit indices, which are null in get_index_buffers() otherwise
+		const std::vector<std::shared_ptr<cg::resource<uint16_t>>>& get_short_index_buffers() const;
+		// Indices of the full resolution mesh, the coarser levels follow them in the index buffer
+		size_t get_index_count(size_t shape_id) const;
+
+		const std::vector<std::vector<shape_lod>>& get_per_shape_lods() const;
+		// Meshlets of all the levels of detail, their index offsets are absolute
+		const std::vector<std::shared_ptr<cg::resource<cg::meshlet>>>& get_meshlet_buffers() const;
+		// Coarsest level of the shape whose error stays within max_error_pixels on the screen
+		const shape_lod& select_lod(size_t shape_id, const camera& camera, float max_error_pixels) const;
+		// The same for a copy of the shape placed by an instance transform in model space
+		const shape_lod& select_lod(size_t shape_id, const camera& camera, float max_error_pixels, const float4x4& instance_transform) const;
 
 		const float4x4 get_world_matrix() const;
 
 	protected:
 
-		std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffers;
+		std::vector<std::shared_ptr<cg::resource<float3>>> position_buffers;
+		std::vector<std::shared_ptr<cg::resource<cg::vertex_attributes>>> attribute_buffers;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
+		std::vector<cg::material> materials;
+		std::vector<unsigned int> material_ids;
+		std::vector<std::shared_ptr<cg::resource<cg::quantized_position>>> quantized_position_buffers;
+		std::vector<std::shared_ptr<cg::resource<cg::packed_vertex_attributes>>> packed_attribute_buffers;
+		std::vector<std::shared_ptr<cg::resource<uint16_t>>> short_index_buffers;
 		std::vector<std::filesystem::path> textures;
+		std::vector<shape_bounds> bounds;
+		std::vector<std::vector<shape_lod>> lods;
+		std::vector<std::shared_ptr<cg::resource<cg::meshlet>>> meshlet_buffers;
+		std::vector<std::filesystem::path> material_libraries;
+		bool optimized = false;
+		size_t lod_levels = 1;
 
-		void allocate_buffers(const std::vector<tinyobj::shape_t>& shapes);
 		static float3 compute_normal(const tinyobj::attrib_t& attrib, const tinyobj::mesh_t& mesh, size_t index_offset);
-		static void fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, tinyobj::index_t idx, float3 computed_normal, tinyobj::material_t material);
-		void fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& materials, const std::filesystem::path& base_folder);
+		static void fill_vertex_data(float3& position, cg::vertex_attributes& attributes, const tinyobj::attrib_t& attrib, tinyobj::index_t idx, float3 computed_normal);
+		void fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& obj_materials, const std::filesystem::path& base_folder, bool optimize, size_t max_lod_levels);
+		static shape_bounds compute_bounds(cg::resource<float3>& position_buffer);
+
+		bool load_cache(const std::filesystem::path& cache_path, const std::filesystem::path& model_path, bool optimize, size_t max_lod_levels);
+		void save_cache(const std::filesystem::path& cache_path, const std::filesystem::path& model_path) const;
+		static uint64_t source_hash(const std::filesystem::path& model_path, const std::vector<std::filesystem::path>& libraries);
 	};
 }// namespace cg::world
\ No newline at end of file
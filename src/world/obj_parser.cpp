@@ -0,0 +1,451 @@
+#include "obj_parser.h"
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+
+
+using namespace cg::world;
+
+namespace
+{
+	// Smallest line range given to a thread, small files are parsed by a single one
+	constexpr size_t MIN_CHUNK_SIZE = 256 * 1024;
+
+	enum class line_type
+	{
+		other,
+		vertex,
+		normal,
+		texcoord,
+		face,
+		group,
+		material,
+		material_library
+	};
+
+	// Lines that change the state of the following faces, in the file order
+	struct command
+	{
+		line_type type;
+		std::string name;
+		// Number of triangles of the chunk before the command
+		size_t num_triangles;
+	};
+
+	struct chunk
+	{
+		const char* begin = nullptr;
+		const char* end = nullptr;
+
+		size_t num_vertices = 0;
+		size_t num_normals = 0;
+		size_t num_texcoords = 0;
+
+		// Number of the attributes in all the chunks before this one
+		size_t vertex_offset = 0;
+		size_t normal_offset = 0;
+		size_t texcoord_offset = 0;
+
+		// Triangulated faces with the indices already resolved to the whole file
+		std::vector<tinyobj::index_t> indices;
+		std::vector<command> commands;
+		// First malformed face, thrown after the parallel parse
+		std::string error;
+	};
+
+	bool is_space(char c)
+	{
+		return c == ' ' || c == '\t';
+	}
+
+	const char* skip_spaces(const char* p, const char* line_end)
+	{
+		while (p < line_end && is_space(*p))
+			p++;
+		return p;
+	}
+
+	const char* find_line_end(const char* p, const char* end)
+	{
+		auto found = static_cast<const char*>(std::memchr(p, '\n', end - p));
+		return found ? found : end;
+	}
+
+	bool starts_with_keyword(const char* p, const char* line_end, const char* keyword)
+	{
+		size_t length = std::strlen(keyword);
+		return static_cast<size_t>(line_end - p) > length &&
+			   std::strncmp(p, keyword, length) == 0 && is_space(p[length]);
+	}
+
+	// Classifies the line and moves the pointer past its keyword
+	line_type classify(const char*& p, const char* line_end)
+	{
+		p = skip_spaces(p, line_end);
+		if (line_end - p < 2)
+			return line_type::other;
+
+		if (p[0] == 'v')
+		{
+			if (is_space(p[1]))
+			{
+				p += 1;
+				return line_type::vertex;
+			}
+			if (starts_with_keyword(p, line_end, "vn"))
+			{
+				p += 2;
+				return line_type::normal;
+			}
+			if (starts_with_keyword(p, line_end, "vt"))
+			{
+				p += 2;
+				return line_type::texcoord;
+			}
+			return line_type::other;
+		}
+		if (p[0] == 'f' && is_space(p[1]))
+		{
+			p += 1;
+			return line_type::face;
+		}
+		if ((p[0] == 'g' || p[0] == 'o') && is_space(p[1]))
+		{
+			p += 1;
+			return line_type::group;
+		}
+		if (starts_with_keyword(p, line_end, "usemtl"))
+		{
+			p += 6;
+			return line_type::material;
+		}
+		if (starts_with_keyword(p, line_end, "mtllib"))
+		{
+			p += 6;
+			return line_type::material_library;
+		}
+		return line_type::other;
+	}
+
+	// Missing components are read as zeros
+	float parse_float(const char*& p, const char* line_end)
+	{
+		p = skip_spaces(p, line_end);
+		if (p >= line_end || *p == '\r')
+			return 0.f;
+		char* next;
+		float value = std::strtof(p, &next);
+		p = next;
+		return value;
+	}
+
+	std::string parse_name(const char* p, const char* line_end)
+	{
+		p = skip_spaces(p, line_end);
+		const char* name_end = line_end;
+		while (name_end > p && (is_space(name_end[-1]) || name_end[-1] == '\r'))
+			name_end--;
+		return std::string(p, name_end);
+	}
+
+	// Names separated by spaces, like the file names of a mtllib line
+	std::vector<std::string> split_names(const std::string& names)
+	{
+		std::vector<std::string> result;
+		const char* p = names.data();
+		const char* end = p + names.size();
+		while ((p = skip_spaces(p, end)) < end)
+		{
+			const char* name_end = p;
+			while (name_end < end && !is_space(*name_end))
+				name_end++;
+			result.emplace_back(p, name_end);
+			p = name_end;
+		}
+		return result;
+	}
+
+	// OBJ indices start at 1, negative ones count back from the last attribute. A missing
+	// index resolves to -1, false means it's outside of the count attributes parsed so far.
+	bool resolve_index(long index, size_t count, int& resolved)
+	{
+		long signed_count = static_cast<long>(count);
+		if (index > signed_count || index < -signed_count)
+			return false;
+		if (index > 0)
+			resolved = static_cast<int>(index - 1);
+		else if (index < 0)
+			resolved = static_cast<int>(signed_count + index);
+		else
+			resolved = -1;
+		return true;
+	}
+
+	// Like tinyobjloader, a face with a missing position or an index out of range is an error
+	bool parse_face(const char* p, const char* line_end, chunk& chunk, std::vector<tinyobj::index_t>& polygon)
+	{
+		size_t num_vertices = chunk.vertex_offset + chunk.num_vertices;
+		size_t num_normals = chunk.normal_offset + chunk.num_normals;
+		size_t num_texcoords = chunk.texcoord_offset + chunk.num_texcoords;
+
+		polygon.clear();
+		while (true)
+		{
+			p = skip_spaces(p, line_end);
+			if (p >= line_end || *p == '\r')
+				break;
+
+			// v, v/vt, v//vn or v/vt/vn
+			long values[3] = {0, 0, 0};
+			for (size_t i = 0; i < 3; i++)
+			{
+				if (i > 0)
+				{
+					if (*p != '/')
+						break;
+					p++;
+				}
+				// strtol would skip a line break, so only digits and signs are handed to it
+				if (p >= line_end || !(std::isdigit(static_cast<unsigned char>(*p)) || *p == '-' || *p == '+'))
+					continue;
+				char* next;
+				values[i] = std::strtol(p, &next, 10);
+				p = next;
+			}
+			while (p < line_end && !is_space(*p) && *p != '\r')
+				p++;
+
+			tinyobj::index_t index;
+			if (values[0] == 0 || !resolve_index(values[0], num_vertices, index.vertex_index) ||
+				!resolve_index(values[2], num_normals, index.normal_index) ||
+				!resolve_index(values[1], num_texcoords, index.texcoord_index))
+				return false;
+			polygon.push_back(index);
+		}
+
+		// Fan triangulation
+		for (size_t i = 1; i + 1 < polygon.size(); i++)
+		{
+			chunk.indices.push_back(polygon[0]);
+			chunk.indices.push_back(polygon[i]);
+			chunk.indices.push_back(polygon[i + 1]);
+		}
+		return true;
+	}
+
+	void count_attributes(chunk& chunk)
+	{
+		for (const char* p = chunk.begin; p < chunk.end;)
+		{
+			const char* line_end = find_line_end(p, chunk.end);
+			switch (classify(p, line_end))
+			{
+				case line_type::vertex:
+					chunk.num_vertices++;
+					break;
+				case line_type::normal:
+					chunk.num_normals++;
+					break;
+				case line_type::texcoord:
+					chunk.num_texcoords++;
+					break;
+				default:
+					break;
+			}
+			p = line_end + 1;
+		}
+	}
+
+	void parse_chunk(chunk& chunk, tinyobj::attrib_t& attrib)
+	{
+		// The counters are rebuilt while parsing, the faces need them to resolve negative indices
+		chunk.num_vertices = chunk.num_normals = chunk.num_texcoords = 0;
+		std::vector<tinyobj::index_t> polygon;
+		for (const char* p = chunk.begin; p < chunk.end;)
+		{
+			const char* line_end = find_line_end(p, chunk.end);
+			line_type type = classify(p, line_end);
+			switch (type)
+			{
+				case line_type::vertex:
+				{
+					float* vertex = &attrib.vertices[3 * (chunk.vertex_offset + chunk.num_vertices++)];
+					for (size_t i = 0; i < 3; i++)
+						vertex[i] = parse_float(p, line_end);
+					break;
+				}
+				case line_type::normal:
+				{
+					float* normal = &attrib.normals[3 * (chunk.normal_offset + chunk.num_normals++)];
+					for (size_t i = 0; i < 3; i++)
+						normal[i] = parse_float(p, line_end);
+					break;
+				}
+				case line_type::texcoord:
+				{
+					float* texcoord = &attrib.texcoords[2 * (chunk.texcoord_offset + chunk.num_texcoords++)];
+					for (size_t i = 0; i < 2; i++)
+						texcoord[i] = parse_float(p, line_end);
+					break;
+				}
+				case line_type::face:
+					if (!parse_face(p, line_end, chunk, polygon) && chunk.error.empty())
+						chunk.error = "Face index out of range: f" + std::string(p, line_end);
+					break;
+				case line_type::group:
+				case line_type::material:
+				case line_type::material_library:
+					chunk.commands.push_back(command{type, parse_name(p, line_end), chunk.indices.size() / 3});
+					break;
+				default:
+					break;
+			}
+			p = line_end + 1;
+		}
+	}
+
+	std::vector<chunk> split_into_chunks(const std::string& text)
+	{
+		size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+		size_t num_chunks = std::clamp(text.size() / MIN_CHUNK_SIZE, size_t{1}, 4 * hardware_threads);
+
+		std::vector<chunk> chunks;
+		const char* end = text.data() + text.size();
+		const char* begin = text.data();
+		for (size_t i = 1; i <= num_chunks && begin < end; i++)
+		{
+			// Every chunk ends after a line break
+			const char* chunk_end = i == num_chunks ? end : find_line_end(text.data() + i * text.size() / num_chunks, end);
+			if (chunk_end < end)
+				chunk_end++;
+			if (chunk_end <= begin)
+				continue;
+			chunks.emplace_back();
+			chunks.back().begin = begin;
+			chunks.back().end = chunk_end;
+			begin = chunk_end;
+		}
+		return chunks;
+	}
+}// namespace
+
+obj_data cg::world::parse_obj(const std::filesystem::path& obj_path, const std::filesystem::path& mtl_search_path)
+{
+	std::ifstream file(obj_path, std::ios::binary | std::ios::ate);
+	if (!file)
+		THROW_ERROR("Can't open " + obj_path.string());
+	std::string text(static_cast<size_t>(file.tellg()), '\0');
+	file.seekg(0);
+	file.read(text.data(), static_cast<std::streamsize>(text.size()));
+
+	std::vector<chunk> chunks = split_into_chunks(text);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < static_cast<int>(chunks.size()); i++)
+	{
+		count_attributes(chunks[i]);
+	}
+
+	obj_data result;
+	size_t num_vertices = 0;
+	size_t num_normals = 0;
+	size_t num_texcoords = 0;
+	for (auto& chunk: chunks)
+	{
+		chunk.vertex_offset = num_vertices;
+		chunk.normal_offset = num_normals;
+		chunk.texcoord_offset = num_texcoords;
+		num_vertices += chunk.num_vertices;
+		num_normals += chunk.num_normals;
+		num_texcoords += chunk.num_texcoords;
+	}
+	result.attrib.vertices.resize(3 * num_vertices);
+	result.attrib.normals.resize(3 * num_normals);
+	result.attrib.texcoords.resize(2 * num_texcoords);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < static_cast<int>(chunks.size()); i++)
+	{
+		parse_chunk(chunks[i], result.attrib);
+	}
+	for (const auto& chunk: chunks)
+	{
+		if (!chunk.error.empty())
+			THROW_ERROR(obj_path.string() + ": " + chunk.error);
+	}
+
+	// Stitch the faces into shapes, a group line starts a new shape once the current one has faces
+	std::map<std::string, int> material_map;
+	int material_id = -1;
+	tinyobj::shape_t shape;
+	auto flush_shape = [&]() {
+		if (!shape.mesh.indices.empty())
+			result.shapes.push_back(std::move(shape));
+		shape = tinyobj::shape_t{};
+	};
+	auto append_triangles = [&](const chunk& chunk, size_t begin, size_t end) {
+		auto& mesh = shape.mesh;
+		mesh.indices.insert(mesh.indices.end(), chunk.indices.begin() + 3 * begin, chunk.indices.begin() + 3 * end);
+		mesh.num_face_vertices.insert(mesh.num_face_vertices.end(), end - begin, 3);
+		mesh.material_ids.insert(mesh.material_ids.end(), end - begin, material_id);
+	};
+
+	for (const auto& chunk: chunks)
+	{
+		size_t appended = 0;
+		for (const auto& command: chunk.commands)
+		{
+			append_triangles(chunk, appended, command.num_triangles);
+			appended = command.num_triangles;
+
+			if (command.type == line_type::group)
+			{
+				flush_shape();
+				shape.name = command.name;
+			}
+			else if (command.type == line_type::material)
+			{
+				auto found = material_map.find(command.name);
+				material_id = found == material_map.end() ? -1 : found->second;
+			}
+			else
+			{
+				// Like tinyobjloader, the first of the listed libraries that opens is loaded
+				std::ifstream material_file;
+				std::filesystem::path material_path;
+				for (const auto& name: split_names(command.name))
+				{
+					material_path = mtl_search_path / name;
+					material_file.open(material_path);
+					if (material_file)
+						break;
+					material_file.clear();
+				}
+				if (!material_file.is_open())
+				{
+					std::cout << "Can't open the material library " << command.name << "\n";
+					continue;
+				}
+				result.material_libraries.push_back(material_path);
+				std::string warning;
+				std::string error;
+				tinyobj::LoadMtl(&material_map, &result.materials, &material_file, &warning, &error);
+				if (!error.empty())
+					THROW_ERROR(error);
+			}
+		}
+		append_triangles(chunk, appended, chunk.indices.size() / 3);
+	}
+	flush_shape();
+
+	return result;
+}
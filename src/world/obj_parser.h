@@ -0,0 +1,24 @@
+#pragma once
+
+#include <filesystem>
+#include <tiny_obj_loader.h>
+#include <vector>
+
+
+namespace cg::world
+{
+	// Contents of an OBJ file in the layout of tinyobjloader, faces are triangulated
+	struct obj_data
+	{
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::shape_t> shapes;
+		std::vector<tinyobj::material_t> materials;
+		// Material libraries that have been read
+		std::vector<std::filesystem::path> material_libraries;
+	};
+
+	// Parses an OBJ file on all cores. The text is split into line ranges, the
+	// ranges are counted, then parsed straight into the preallocated attributes,
+	// and their faces are stitched into shapes in the file order at the end.
+	obj_data parse_obj(const std::filesystem::path& obj_path, const std::filesystem::path& mtl_search_path);
+}// namespace cg::world
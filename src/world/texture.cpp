@@ -0,0 +1,127 @@
+#define STB_IMAGE_IMPLEMENTATION
+
+#include "texture.h"
+
+#include <stb_image.h>
+
+
+using namespace cg::world;
+
+texture_filter cg::world::parse_texture_filter(const std::string& name)
+{
+	if (name == "bilinear")
+		return texture_filter::bilinear;
+	if (name == "trilinear")
+		return texture_filter::trilinear;
+	THROW_ERROR("Unknown texture filter: " + name);
+}
+
+std::shared_ptr<texture> texture::load(const std::filesystem::path& path)
+{
+	int width = 0;
+	int height = 0;
+	int channels = 0;
+	stbi_uc* pixels = stbi_load(path.string().c_str(), &width, &height, &channels, 4);
+	if (!pixels)
+		THROW_ERROR("Can't load texture " + path.string() + ": " + stbi_failure_reason());
+
+	// Images are stored top row first, texture coordinates have v = 0 at the bottom
+	std::vector<cg::unsigned_color4> texels(static_cast<size_t>(width) * height);
+	for (int y = 0; y < height; y++)
+	{
+		const stbi_uc* source = pixels + static_cast<size_t>(height - 1 - y) * width * 4;
+		for (int x = 0; x < width; x++)
+		{
+			texels[static_cast<size_t>(y) * width + x] = cg::unsigned_color4{
+					source[4 * x], source[4 * x + 1], source[4 * x + 2], source[4 * x + 3]};
+		}
+	}
+	stbi_image_free(pixels);
+	return std::make_shared<texture>(texels.data(), width, height);
+}
+
+texture::texture(const cg::unsigned_color4* texels, size_t width, size_t height)
+{
+	if (width == 0 || height == 0)
+		THROW_ERROR("Textures can't be empty");
+
+	cg::resource_allocation allocation;
+	allocation.layout = cg::resource_layout::morton;
+	auto base = std::make_shared<cg::resource<cg::unsigned_color4>>(width, height, allocation);
+	for (size_t y = 0; y < height; y++)
+	{
+		for (size_t x = 0; x < width; x++)
+			base->item(x, y) = texels[y * width + x];
+	}
+	add_level(base);
+
+	// Every texel of a level averages up to 2x2 texels of the previous one, odd
+	// sides fold their last texel into the one before
+	while (width > 1 || height > 1)
+	{
+		auto& previous = *levels.back().texels;
+		size_t next_width = std::max(width / 2, size_t{1});
+		size_t next_height = std::max(height / 2, size_t{1});
+		auto next = std::make_shared<cg::resource<cg::unsigned_color4>>(next_width, next_height, allocation);
+		for (size_t y = 0; y < next_height; y++)
+		{
+			size_t y0 = std::min(2 * y, height - 1);
+			size_t y1 = std::min(2 * y + 1, height - 1);
+			for (size_t x = 0; x < next_width; x++)
+			{
+				size_t x0 = std::min(2 * x, width - 1);
+				size_t x1 = std::min(2 * x + 1, width - 1);
+				const cg::unsigned_color4* corners[4] = {
+						&previous.item(x0, y0), &previous.item(x1, y0),
+						&previous.item(x0, y1), &previous.item(x1, y1)};
+				unsigned int r = 0, g = 0, b = 0, a = 0;
+				for (const auto* corner: corners)
+				{
+					r += corner->r;
+					g += corner->g;
+					b += corner->b;
+					a += corner->a;
+				}
+				next->item(x, y) = cg::unsigned_color4{
+						static_cast<uint8_t>((r + 2) / 4),
+						static_cast<uint8_t>((g + 2) / 4),
+						static_cast<uint8_t>((b + 2) / 4),
+						static_cast<uint8_t>((a + 2) / 4)};
+			}
+		}
+		add_level(next);
+		width = next_width;
+		height = next_height;
+	}
+}
+
+void texture::add_level(std::shared_ptr<cg::resource<cg::unsigned_color4>> texels)
+{
+	level current;
+	current.data = texels->data();
+	current.width = static_cast<int>(texels->get_width());
+	current.height = static_cast<int>(texels->get_height());
+	current.tiles_x = (texels->get_width() + cg::RESOURCE_TILE_SIZE - 1) / cg::RESOURCE_TILE_SIZE;
+	current.size = float2{static_cast<float>(current.width), static_cast<float>(current.height)};
+	current.texels = std::move(texels);
+	levels.push_back(std::move(current));
+}
+
+size_t texture::size_bytes() const
+{
+	size_t result = 0;
+	for (const auto& current: levels)
+		result += current.texels->size_bytes();
+	return result;
+}
+
+std::shared_ptr<texture> texture::get_tail(size_t max_size) const
+{
+	size_t first = 0;
+	while (first + 1 < levels.size() &&
+		   (static_cast<size_t>(levels[first].width) > max_size || static_cast<size_t>(levels[first].height) > max_size))
+		first++;
+	std::shared_ptr<texture> result(new texture());
+	result->levels.assign(levels.begin() + first, levels.end());
+	return result;
+}
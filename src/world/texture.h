@@ -0,0 +1,168 @@
+#pragma once
+
+#include "resource.h"
+
+#include <cmath>
+#include <filesystem>
+#include <linalg.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::world
+{
+	enum class texture_filter
+	{
+		// Bilinear filtering of the nearest mip level
+		bilinear,
+		// Bilinear filtering of the two nearest mip levels, blended by the level of detail
+		trilinear
+	};
+
+	// Filter of its command line name, bilinear or trilinear
+	texture_filter parse_texture_filter(const std::string& name);
+
+	// Mip-mapped RGBA8 texture with repeating coordinates. Every level is a resource
+	// in the morton layout, so the 2x2 footprint of a bilinear fetch mostly stays
+	// within one 8x8 tile of 256 bytes. Sampling only reads, so it's safe from any
+	// number of threads.
+	class texture
+	{
+	public:
+		// Decodes the image and builds the full mip chain down to 1x1, box filtered
+		static std::shared_ptr<texture> load(const std::filesystem::path& path);
+		// Takes the texels of level 0 row after row and builds the rest of the chain
+		texture(const unsigned_color4* texels, size_t width, size_t height);
+
+		size_t get_width() const;
+		size_t get_height() const;
+		size_t get_level_count() const;
+		size_t size_bytes() const;
+		// Texture of the levels whose sides are at most max_size, sharing their texels
+		std::shared_ptr<texture> get_tail(size_t max_size) const;
+
+		// Level of detail from the screen space derivatives of the texture
+		// coordinates, log2 of the texels the pixel footprint spans
+		float compute_lod(const float2& duv_dx, const float2& duv_dy) const;
+		// Level of detail of an isotropic footprint, its width in texture coordinates
+		float compute_lod(float footprint) const;
+
+		float4 sample_bilinear(const float2& uv, size_t level) const;
+		float4 sample_trilinear(const float2& uv, float lod) const;
+		float4 sample(const float2& uv, float lod, texture_filter filter) const;
+
+	protected:
+		texture() = default;
+
+		struct level
+		{
+			std::shared_ptr<resource<unsigned_color4>> texels;
+			// Copies of the resource state the sampling needs
+			const unsigned_color4* data;
+			int width;
+			int height;
+			size_t tiles_x;
+			float2 size;
+		};
+		std::vector<level> levels;
+
+		void add_level(std::shared_ptr<resource<unsigned_color4>> texels);
+		static float wrap(float coordinate, float size);
+		static float4 fetch(const level& level, int x, int y);
+	};
+
+	inline size_t texture::get_width() const
+	{
+		return levels.front().width;
+	}
+
+	inline size_t texture::get_height() const
+	{
+		return levels.front().height;
+	}
+
+	inline size_t texture::get_level_count() const
+	{
+		return levels.size();
+	}
+
+	inline float texture::compute_lod(const float2& duv_dx, const float2& duv_dy) const
+	{
+		const float2& size = levels.front().size;
+		float2 dx = duv_dx * size;
+		float2 dy = duv_dy * size;
+		float footprint2 = std::max(dot(dx, dx), dot(dy, dy));
+		// log2 of the square root
+		return 0.5f * std::log2(std::max(footprint2, 1e-12f));
+	}
+
+	inline float texture::compute_lod(float footprint) const
+	{
+		const float2& size = levels.front().size;
+		return std::log2(std::max(footprint * std::sqrt(size.x * size.y), 1e-6f));
+	}
+
+	inline float texture::wrap(float coordinate, float size)
+	{
+		// Wrapped before the conversion to int, which is undefined for huge and NaN
+		// coordinates. Those don't land in [0, size) and take the first texel.
+		float wrapped = coordinate - size * std::floor(coordinate / size);
+		return wrapped >= 0.f && wrapped < size ? wrapped : 0.f;
+	}
+
+	inline float4 texture::fetch(const level& level, int x, int y)
+	{
+		const unsigned_color4& texel = level.data[morton_offset(static_cast<size_t>(x), static_cast<size_t>(y), level.tiles_x)];
+		return float4{
+					   static_cast<float>(texel.r),
+					   static_cast<float>(texel.g),
+					   static_cast<float>(texel.b),
+					   static_cast<float>(texel.a)} *
+			   (1.f / 255.f);
+	}
+
+	inline float4 texture::sample_bilinear(const float2& uv, size_t level_id) const
+	{
+		const level& current = levels[std::min(level_id, levels.size() - 1)];
+		// Texel centers are at half coordinates
+		float x = wrap(uv.x * current.size.x - 0.5f, current.size.x);
+		float y = wrap(uv.y * current.size.y - 0.5f, current.size.y);
+		float floor_x = std::floor(x);
+		float floor_y = std::floor(y);
+		float fraction_x = x - floor_x;
+		float fraction_y = y - floor_y;
+
+		int x0 = static_cast<int>(floor_x);
+		int y0 = static_cast<int>(floor_y);
+		int x1 = x0 + 1 == current.width ? 0 : x0 + 1;
+		int y1 = y0 + 1 == current.height ? 0 : y0 + 1;
+
+		float4 top = lerp(fetch(current, x0, y0), fetch(current, x1, y0), fraction_x);
+		float4 bottom = lerp(fetch(current, x0, y1), fetch(current, x1, y1), fraction_x);
+		return lerp(top, bottom, fraction_y);
+	}
+
+	inline float4 texture::sample_trilinear(const float2& uv, float lod) const
+	{
+		float max_lod = static_cast<float>(levels.size() - 1);
+		lod = std::clamp(lod, 0.f, max_lod);
+		float floor_lod = std::floor(lod);
+		size_t level_id = static_cast<size_t>(floor_lod);
+		float fraction = lod - floor_lod;
+		float4 fine = sample_bilinear(uv, level_id);
+		if (fraction == 0.f)
+			return fine;
+		return lerp(fine, sample_bilinear(uv, level_id + 1), fraction);
+	}
+
+	inline float4 texture::sample(const float2& uv, float lod, texture_filter filter) const
+	{
+		if (filter == texture_filter::trilinear)
+			return sample_trilinear(uv, lod);
+		float max_lod = static_cast<float>(levels.size() - 1);
+		return sample_bilinear(uv, static_cast<size_t>(std::clamp(std::round(lod), 0.f, max_lod)));
+	}
+}// namespace cg::world
@@ -0,0 +1,194 @@
+#include "texture_streamer.h"
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <iostream>
+
+
+using namespace cg::world;
+
+texture_streamer::texture_streamer(size_t budget_bytes, size_t num_threads) : budget_bytes(budget_bytes)
+{
+	cg::unsigned_color4 white{255, 255, 255, 255};
+	placeholder = std::make_shared<texture>(&white, 1, 1);
+
+	if (num_threads == 0)
+		num_threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	for (size_t i = 0; i < num_threads; i++)
+		workers.emplace_back(&texture_streamer::worker, this);
+}
+
+texture_streamer::~texture_streamer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	work_ready.notify_all();
+	for (auto& worker: workers)
+		worker.join();
+}
+
+void texture_streamer::prefetch(const std::vector<std::filesystem::path>& paths)
+{
+	for (const auto& path: paths)
+	{
+		if (!path.empty())
+			request(path, entries[path]);
+	}
+}
+
+std::vector<std::shared_ptr<texture>> texture_streamer::get_textures(const std::vector<std::filesystem::path>& paths)
+{
+	std::vector<std::shared_ptr<texture>> result(paths.size());
+	for (size_t i = 0; i < paths.size(); i++)
+	{
+		if (paths[i].empty())
+			continue;
+		entry& current = entries[paths[i]];
+		current.last_used = frame;
+		if (current.failed)
+			continue;
+		if (current.full)
+		{
+			result[i] = current.full;
+			continue;
+		}
+		request(paths[i], current);
+		result[i] = current.fallback ? current.fallback : placeholder;
+	}
+	return result;
+}
+
+void texture_streamer::update()
+{
+	publish();
+	evict();
+	frame++;
+}
+
+void texture_streamer::wait()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		work_done.wait(lock, [this]() { return queue.empty() && in_flight == 0; });
+	}
+	update();
+}
+
+streaming_statistics texture_streamer::get_statistics() const
+{
+	streaming_statistics result;
+	result.files = entries.size();
+	for (const auto& [path, current]: entries)
+	{
+		result.resident += current.full ? 1 : 0;
+		result.pending += current.queued ? 1 : 0;
+		result.failed += current.failed ? 1 : 0;
+	}
+	result.evicted = evicted;
+	result.resident_bytes = resident_bytes;
+	result.budget_bytes = budget_bytes;
+	return result;
+}
+
+void texture_streamer::request(const std::filesystem::path& path, entry& entry)
+{
+	if (entry.queued || entry.full || entry.failed)
+		return;
+	entry.queued = true;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(path);
+	}
+	work_ready.notify_one();
+}
+
+void texture_streamer::publish()
+{
+	std::vector<decoded_texture> finished;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finished.swap(decoded);
+	}
+	for (auto& result: finished)
+	{
+		entry& current = entries[result.path];
+		current.queued = false;
+		if (!result.result)
+		{
+			current.failed = true;
+			std::cerr << result.error << "\n";
+			continue;
+		}
+		current.full = std::move(result.result);
+		current.fallback = current.full->get_tail(STREAMING_FALLBACK_SIZE);
+	}
+}
+
+void texture_streamer::evict()
+{
+	resident_bytes = 0;
+	for (const auto& [path, current]: entries)
+	{
+		if (current.full)
+			resident_bytes += current.full->size_bytes();
+		else if (current.fallback)
+			resident_bytes += current.fallback->size_bytes();
+	}
+
+	if (resident_bytes <= budget_bytes)
+		return;
+
+	// Only the levels above the fallback go, least recently used first. The current frame
+	// holds its textures, and the prefetched ones that no frame used yet count as used now.
+	std::vector<entry*> candidates;
+	for (auto& [path, current]: entries)
+	{
+		if (current.full && current.last_used != frame)
+			candidates.push_back(&current);
+	}
+	auto recency = [this](const entry* current) { return current->last_used ? current->last_used : frame; };
+	std::sort(candidates.begin(), candidates.end(), [&](const entry* a, const entry* b) {
+		return recency(a) < recency(b);
+	});
+	for (entry* oldest: candidates)
+	{
+		if (resident_bytes <= budget_bytes)
+			break;
+		resident_bytes -= oldest->full->size_bytes() - oldest->fallback->size_bytes();
+		oldest->full.reset();
+		evicted++;
+	}
+}
+
+void texture_streamer::worker()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		work_ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+		if (stopping)
+			return;
+		decoded_texture result;
+		result.path = std::move(queue.front());
+		queue.pop_front();
+		in_flight++;
+
+		lock.unlock();
+		try
+		{
+			result.result = texture::load(result.path);
+		}
+		catch (const std::exception& e)
+		{
+			result.error = error_message(e);
+		}
+		lock.lock();
+
+		decoded.push_back(std::move(result));
+		in_flight--;
+		work_done.notify_all();
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "texture.h"
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace cg::world
+{
+	// Largest side of the mip levels a texture keeps once it was decoded
+	constexpr size_t STREAMING_FALLBACK_SIZE = 32;
+
+	struct streaming_statistics
+	{
+		// Distinct texture files, and how many of them have all their levels resident
+		size_t files = 0;
+		size_t resident = 0;
+		// Queued or being decoded
+		size_t pending = 0;
+		size_t failed = 0;
+		// Full mip chains dropped over the budget so far
+		size_t evicted = 0;
+		size_t resident_bytes = 0;
+		size_t budget_bytes = 0;
+	};
+
+	// Decodes texture files on background threads, so the frame doesn't wait for
+	// all of them. A texture that isn't decoded yet is a 1x1 white placeholder, so
+	// its shapes show the plain material color. A decoded texture keeps its levels
+	// up to STREAMING_FALLBACK_SIZE for good, the rest of the chain counts against
+	// the budget: the least recently used chains are dropped back to the fallback
+	// levels and decoded again when they're used next. The chains of the current
+	// frame stay, even over the budget.
+	//
+	// The workers only decode. Residency changes in update() on the render thread,
+	// between the frames, and the textures returned for a frame stay valid as long
+	// as the frame holds them.
+	class texture_streamer
+	{
+	public:
+		// No thread count takes one less than the hardware threads, at least one
+		texture_streamer(size_t budget_bytes, size_t num_threads = 0);
+		~texture_streamer();
+
+		// Queues the files that aren't resident yet, without marking them used
+		void prefetch(const std::vector<std::filesystem::path>& paths);
+		// Textures of the paths for the current frame, null for an empty path or a file
+		// that can't be decoded. Marks them used and queues the ones to be decoded.
+		std::vector<std::shared_ptr<texture>> get_textures(const std::vector<std::filesystem::path>& paths);
+		// Publishes the textures decoded since the last call, evicts the chains over
+		// the budget and starts the next frame
+		void update();
+		// Blocks until the queue is empty, then publishes like update()
+		void wait();
+
+		streaming_statistics get_statistics() const;
+
+	protected:
+		struct entry
+		{
+			std::shared_ptr<texture> full;
+			std::shared_ptr<texture> fallback;
+			size_t last_used = 0;
+			bool queued = false;
+			bool failed = false;
+		};
+		// Touched only by the render thread
+		std::map<std::filesystem::path, entry> entries;
+		std::shared_ptr<texture> placeholder;
+		size_t budget_bytes;
+		size_t resident_bytes = 0;
+		size_t evicted = 0;
+		size_t frame = 1;
+
+		struct decoded_texture
+		{
+			std::filesystem::path path;
+			// Null when the file can't be decoded
+			std::shared_ptr<texture> result;
+			std::string error;
+		};
+		// Shared with the workers
+		std::mutex mutex;
+		std::condition_variable work_ready;
+		std::condition_variable work_done;
+		std::deque<std::filesystem::path> queue;
+		std::vector<decoded_texture> decoded;
+		size_t in_flight = 0;
+		bool stopping = false;
+		std::vector<std::thread> workers;
+
+		void request(const std::filesystem::path& path, entry& entry);
+		void publish();
+		void evict();
+		void worker();
+	};
+}// namespace cg::world